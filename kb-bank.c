@@ -0,0 +1,163 @@
+/*
+ * Keymap banks for the Microwriter / CyKey keyboard emulation.
+ *
+ * As well as the built-in keymap (bank 0, compiled from kb-layout.cpp), up
+ * to KB_BANK_COUNT more keymaps can be loaded into a reserved region at the
+ * top of flash (e.g. with picotool), each in its own KB_BANK_SIZE block and
+ * laid out as a kb_keymap. Each is checked once at start up, by its header
+ * and CRC, and only the good ones can be selected.
+ *
+ * Banks are used in place, straight from flash (nothing here ever writes
+ * the flash, so the XIP cache is never stalled). The active keymap is just
+ * a pointer, switched in one store, and core-1 takes a copy of it at the
+ * start of each chord, so a chord is always decoded with one whole keymap.
+ *
+ * The host keyboard layout tables (see kb-host.cpp) are switched the same way.
+ */
+
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+
+// local parts
+#include "kb-main.h"
+#include "kb-layout.h"
+
+// Each bank takes two flash sectors, in a block at the top of flash
+#define KB_BANK_SIZE (2 * FLASH_SECTOR_SIZE)
+#ifndef KB_BANK_OFFSET
+#define KB_BANK_OFFSET (PICO_FLASH_SIZE_BYTES - (KB_BANK_COUNT * KB_BANK_SIZE))
+#endif
+
+_Static_assert (sizeof (kb_keymap) <= KB_BANK_SIZE, "KB_BANK_SIZE is too small for a keymap");
+_Static_assert ((KB_BANK_OFFSET % FLASH_SECTOR_SIZE) == 0, "KB_BANK_OFFSET must be on a flash sector");
+
+// The end of the program image in flash, from the linker script
+extern char __flash_binary_end;
+
+// The usable banks, NULL where a bank is empty or bad. Set up by bank_init()
+static const kb_keymap *banks [KB_BANK_COUNT + 1];
+
+// The keymap in use
+static const kb_keymap * volatile keymap = &kb_builtin;
+
+// CRC-32 (as zlib), done bitwise - it is only run over the banks at start up
+uint32_t bank_crc (const uint8_t *data, uint32_t len)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    int bit;
+
+    while (len--)
+    {
+        crc ^= *data++;
+        for (bit = 0; bit < 8; ++bit)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+} // bank_crc
+
+// Is this a good keymap, of the version we understand?
+static bool bank_valid (const kb_keymap *km)
+{
+    if ((km->hdr.magic != KB_BANK_MAGIC) || (km->hdr.version != KB_BANK_VERSION) ||
+        (km->hdr.size != (sizeof (kb_keymap) - sizeof (kb_bank_hdr))))
+    {
+        return false; // empty (erased flash), or not a keymap
+    }
+    return (bank_crc ((const uint8_t *)&km->decode, km->hdr.size) == km->hdr.crc);
+} // bank_valid
+
+// Find the good banks in flash. Call once, on core-0, before core-1 is started.
+// Returns the number of flash banks found. If the program has grown into the
+// bank region, there are none - what is there is code, not keymaps.
+uint32_t bank_init (void)
+{
+    uint32_t idx;
+    uint32_t found = 0;
+
+    banks [0] = &kb_builtin;
+    for (idx = 1; idx <= KB_BANK_COUNT; ++idx)
+    {
+        banks [idx] = NULL;
+    }
+    keymap = &kb_builtin;
+    if ((uintptr_t)&__flash_binary_end > (XIP_BASE + KB_BANK_OFFSET))
+    {
+        return 0;
+    }
+
+    for (idx = 1; idx <= KB_BANK_COUNT; ++idx)
+    {
+        const kb_keymap *km = (const kb_keymap *)(XIP_BASE + KB_BANK_OFFSET + ((idx - 1) * KB_BANK_SIZE));
+        banks [idx] = bank_valid (km) ? km : NULL;
+        if (banks [idx])
+        {
+            ++found;
+        }
+    }
+    return found;
+} // bank_init
+
+// Switch to another keymap bank - from either core. Returns false if there
+// is no good keymap in that bank, and the current one is kept.
+bool bank_select (uint32_t bank)
+{
+    if ((bank > KB_BANK_COUNT) || (banks [bank] == NULL))
+    {
+        return false;
+    }
+    keymap = banks [bank];
+    return true;
+} // bank_select
+
+// Which bank is in use?
+uint32_t bank_current (void)
+{
+    const kb_keymap *km = keymap;
+    uint32_t idx;
+
+    for (idx = 1; idx <= KB_BANK_COUNT; ++idx)
+    {
+        if (banks [idx] == km)
+        {
+            return idx;
+        }
+    }
+    return 0;
+} // bank_current
+
+// The keymap in use - read once per chord by core-1
+const kb_keymap *bank_keymap (void)
+{
+    return keymap;
+} // bank_keymap
+
+// The host layout in use
+static const hid_tab * volatile host = &host_tabs [KB_HOST_LAYOUT];
+
+// Switch to another host layout - from either core. Returns false if there
+// is no such layout, and the current one is kept.
+bool host_select (uint32_t layout)
+{
+    if (layout >= HOST_LAYOUTS)
+    {
+        return false;
+    }
+    host = &host_tabs [layout];
+    return true;
+} // host_select
+
+// Which host layout is in use?
+uint32_t host_current (void)
+{
+    return (uint32_t)(host - host_tabs);
+} // host_current
+
+// The host layout in use - read once per chord by core-1
+const hid_tab *host_table (void)
+{
+    return host;
+} // host_table
+
+/* End of File */
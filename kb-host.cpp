@@ -0,0 +1,229 @@
+/*
+ * Host keyboard layouts for the Microwriter / CyKey keyboard emulation.
+ *
+ * A USB keyboard does not send characters, it sends key positions, and the
+ * host turns them into characters with whatever layout it is set to. So what
+ * to send for each decoded code depends on the host's layout. Each layout is
+ * written below as the characters on each key, unshifted, shifted and with
+ * AltGr, and compiled (as constexpr) into a table giving the modifiers and
+ * key for every code, so sending a character is one lookup. The table in use
+ * is picked at run time (see kb-bank.c).
+ *
+ * The static_asserts reject a layout with a row the wrong length, or one
+ * that cannot type every printable ASCII character.
+ */
+
+#include <stdint.h>
+
+// tinyusb parts...
+#include <tusb.h>
+
+// local parts
+#include "kb-layout.h"
+
+namespace {
+
+// The keys that type characters, in the order the layouts below give them:
+// the number row, then the top, home and bottom rows. The ISO keys are there
+// too - the one by Enter (Europe 1) and the one by the left Shift (Europe 2).
+constexpr uint8_t host_keys [] = {
+    HID_KEY_GRAVE, HID_KEY_1, HID_KEY_2, HID_KEY_3, HID_KEY_4, HID_KEY_5, HID_KEY_6,
+    HID_KEY_7, HID_KEY_8, HID_KEY_9, HID_KEY_0, HID_KEY_MINUS, HID_KEY_EQUAL,
+
+    HID_KEY_Q, HID_KEY_W, HID_KEY_E, HID_KEY_R, HID_KEY_T, HID_KEY_Y, HID_KEY_U,
+    HID_KEY_I, HID_KEY_O, HID_KEY_P, HID_KEY_BRACKET_LEFT, HID_KEY_BRACKET_RIGHT, HID_KEY_BACKSLASH,
+
+    HID_KEY_A, HID_KEY_S, HID_KEY_D, HID_KEY_F, HID_KEY_G, HID_KEY_H, HID_KEY_J,
+    HID_KEY_K, HID_KEY_L, HID_KEY_SEMICOLON, HID_KEY_APOSTROPHE, HID_KEY_EUROPE_1,
+
+    HID_KEY_EUROPE_2, HID_KEY_Z, HID_KEY_X, HID_KEY_C, HID_KEY_V, HID_KEY_B, HID_KEY_N,
+    HID_KEY_M, HID_KEY_COMMA, HID_KEY_PERIOD, HID_KEY_SLASH
+};
+
+constexpr int NUM_HOST_KEYS = sizeof (host_keys) / sizeof (host_keys [0]);
+
+/* A host layout - the characters on each key, in host_keys order, a space
+ * where there is none. Characters above 127 are in code page 1252, as the
+ * decoder uses. A character only reached by a dead key goes in "dead", and is
+ * sent followed by a space; where there is another way to type it, the dead
+ * key is left out. */
+struct host_def
+{
+    const char *base;
+    const char *shift;
+    const char *altgr;
+    const char *dead;
+};
+
+constexpr host_def host_defs [HOST_LAYOUTS] = {
+    // HOST_US
+    {
+        "`1234567890-="   "qwertyuiop[]\\"  "asdfghjkl;' "   " zxcvbnm,./",
+        "~!@#$%^&*()_+"   "QWERTYUIOP{}|"   "ASDFGHJKL:\" "  " ZXCVBNM<>?",
+        "             "   "             "   "            "   "           ",
+        ""
+    },
+    // HOST_UK
+    {
+        "`1234567890-="   "qwertyuiop[] "   "asdfghjkl;'#"   "\\zxcvbnm,./",
+        "\xAC!\"\xA3$%^&*()_+" "QWERTYUIOP{} " "ASDFGHJKL:@~" "|ZXCVBNM<>?",
+        "\xA6   \x80        " "             " "            "   "           ",
+        ""
+    },
+    // HOST_DE
+    {
+        "^1234567890\xDF\xB4" "qwertzuiop\xFC+ " "asdfghjkl\xF6\xE4#" "<yxcvbnm,.-",
+        "\xB0!\"\xA7$%&/()=?`" "QWERTZUIOP\xDC* " "ASDFGHJKL\xD6\xC4'" ">YXCVBNM;:_",
+        "  \xB2\xB3   {[]}\\ " "@ \x80        ~ " "            " "|      \xB5   ",
+        "^\xB4`"
+    },
+    // HOST_FR
+    {
+        "\xB2&\xE9\"'(-\xE8_\xE7\xE0)=" "azertyuiop $ " "qsdfghjklm\xF9*" "<wxcvbn,;:!",
+        " 1234567890\xB0+" "AZERTYUIOP\xA8\xA3 " "QSDFGHJKLM%\xB5" ">WXCVBN?./\xA7",
+        "  ~#{[|`\\^@]}" "  \x80        \xA4 " "            " "           ",
+        "\xA8~`"
+    },
+};
+
+constexpr int str_len (const char *str)
+{
+    int len = 0;
+    while (str [len])
+    {
+        ++len;
+    }
+    return len;
+} // str_len
+
+constexpr bool is_dead (const host_def &def, uint8_t ch)
+{
+    for (const char *dd = def.dead; *dd; ++dd)
+    {
+        if ((uint8_t)*dd == ch)
+        {
+            return true;
+        }
+    }
+    return false;
+} // is_dead
+
+// convert "internal" codes into USB HID keycodes - the same for every host layout
+constexpr uint8_t int_codes_table [32] = {
+    0,
+    HID_KEY_DELETE,
+    HID_KEY_ARROW_UP,
+    HID_KEY_ARROW_RIGHT,
+    HID_KEY_PAGE_UP,
+    HID_KEY_INSERT,
+    0, // 6 - CTRL one-shot modifier
+    HID_KEY_KEYPAD_ENTER,
+    0, // 8 - clear the modifiers
+    HID_KEY_TAB,
+    HID_KEY_ENTER,
+    HID_KEY_F1,
+    HID_KEY_F2,
+    HID_KEY_F3,
+    HID_KEY_F4,
+    HID_KEY_F5,
+    HID_KEY_F6,
+    HID_KEY_F7,
+    HID_KEY_F8,
+    HID_KEY_F9,
+    HID_KEY_F10,
+    HID_KEY_F11,
+    HID_KEY_F12,
+    0, // 23 - Alt + Ctrl special modifier "A_C" code
+    HID_KEY_HOME,
+    HID_KEY_ARROW_LEFT,
+    HID_KEY_END,
+    HID_KEY_ARROW_DOWN,
+    HID_KEY_PAGE_DOWN,
+    HID_KEY_ESCAPE,
+    HID_KEY_BACKSPACE,
+    0 // 31 - ALT one-shot modifier
+    };
+
+// Work out what to send to the host for every code the decoder can produce
+constexpr hid_tab make_host (const host_def &def)
+{
+    hid_tab tab {};
+
+    // The internal codes, for keys that are not characters
+    for (int cc = 0; cc < SPC; ++cc)
+    {
+        tab.code [cc].key = int_codes_table [cc];
+    }
+    tab.code [CTR].mods_1s = KEYBOARD_MODIFIER_LEFTCTRL;
+    tab.code [ALT].mods_1s = KEYBOARD_MODIFIER_LEFTALT;
+    tab.code [A_C].mods_1s = KEYBOARD_MODIFIER_LEFTCTRL | KEYBOARD_MODIFIER_LEFTALT;
+    tab.code [WIN].mods_1s = KEYBOARD_MODIFIER_LEFTGUI; // WIN as a modifier
+    tab.code [WN2].mods = KEYBOARD_MODIFIER_LEFTGUI;    // WIN as a key on its own
+    tab.code [WN2].key = HID_KEY_GUI_LEFT;
+    tab.code [SPC].key = HID_KEY_SPACE;
+
+    // The characters - the first way found to type each one is kept
+    const char *const level [3] = { def.base, def.shift, def.altgr };
+    const uint8_t level_mods [3] = { 0, KEYBOARD_MODIFIER_LEFTSHIFT, KEYBOARD_MODIFIER_RIGHTALT };
+    for (int lvl = 0; lvl < 3; ++lvl)
+    {
+        for (int idx = 0; idx < NUM_HOST_KEYS; ++idx)
+        {
+            const uint8_t ch = (uint8_t)level [lvl][idx];
+            hid_code &hc = tab.code [ch];
+            if ((ch != SPC) && (hc.key == 0) && (hc.mods_1s == 0))
+            {
+                hc.mods = level_mods [lvl];
+                hc.key = host_keys [idx];
+                hc.flags = is_dead (def, ch) ? HC_DEAD : 0;
+            }
+        }
+    }
+    return tab;
+} // make_host
+
+// Checks on the layouts
+constexpr bool rows_ok (void)
+{
+    for (const host_def &def : host_defs)
+    {
+        if ((str_len (def.base) != NUM_HOST_KEYS) || (str_len (def.shift) != NUM_HOST_KEYS) ||
+            (str_len (def.altgr) != NUM_HOST_KEYS))
+        {
+            return false;
+        }
+    }
+    return true;
+} // rows_ok
+
+constexpr bool ascii_ok (void)
+{
+    for (const host_def &def : host_defs)
+    {
+        const hid_tab tab = make_host (def);
+        for (int cc = SPC; cc < 127; ++cc)
+        {
+            if (tab.code [cc].key == 0)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+} // ascii_ok
+
+static_assert (rows_ok (), "host layouts: a row of keys is the wrong length");
+static_assert (ascii_ok (), "host layouts: a layout cannot type all of printable ASCII");
+static_assert (sizeof (hid_tab) == (256 * 4), "hid_tab must not be padded");
+
+} // namespace
+
+// The tables for each host layout, built by the compiler, so they go in flash
+constexpr hid_tab host_tabs [HOST_LAYOUTS] = {
+    make_host (host_defs [HOST_US]),
+    make_host (host_defs [HOST_UK]),
+    make_host (host_defs [HOST_DE]),
+    make_host (host_defs [HOST_FR]),
+};
+
+/* End of File */
@@ -0,0 +1,664 @@
+/*
+ * Keyboard layout for the Microwriter / CyKey keyboard emulation.
+ *
+ * The layout is written once, below, as a list of chords and what they
+ * type, and compiled (by the C++ compiler, as constexpr) into the const
+ * tables the decoder uses, so they go straight into flash. The decode state
+ * machine table is worked out at compile time too, so there is nothing to
+ * keep in step by hand. It is wrapped up as the built-in keymap bank (see
+ * kb-bank.c). The chords across both hands, for the two-handed build, are
+ * taken from the same layout. What each code sends to the host is in kb-host.cpp.
+ *
+ * The static_asserts at the end of the layout reject a layout with a badly
+ * written chord, the same chord defined twice, or a chord the decoder could
+ * never reach.
+ */
+
+#include <stdint.h>
+
+// local parts
+#include "kb-layout.h"
+
+namespace {
+
+/* Each chord is in one "layer", depending on the modifier keys pressed with
+ * it and the shift state, see the prefixes below for how they are picked. */
+enum layer : uint8_t
+{
+    BASIC, // fingers alone
+    THUMB, // with the Thumb
+    NUMBR, // with Num, or with the Thumb when Num is locked
+    NSHFT, // fingers alone, with Num locked or shifted
+    ESHFT, // fingers alone, in e-Shift
+    ETHMB, // with the Thumb, in e-Shift
+    CMD,   // "Command" codes, with Caps
+    CNTRC, // "Countermand" codes, with Num and Caps, or Num in e-Shift
+    NUM_LAYERS
+};
+
+struct key_def
+{
+    layer       lyr;
+    const char *fingers; // the finger keys - I(ndex), M(iddle), R(ing), P(inky)
+    uint8_t     code;    // ASCII, or one of the internal codes from kb-layout.h
+};
+
+// The layout
+constexpr key_def layout [] = {
+    // Fingers alone
+    { BASIC, "P",     'u'  }, { BASIC, "R",     's'  }, { BASIC, "RP",    'g'  },
+    { BASIC, "M",     'o'  }, { BASIC, "MP",    'q'  }, { BASIC, "MR",    'n'  },
+    { BASIC, "MRP",   'b'  }, { BASIC, "I",     'e'  }, { BASIC, "IP",    'v'  },
+    { BASIC, "IR",    't'  }, { BASIC, "IRP",   ','  }, { BASIC, "IM",    'a'  },
+    { BASIC, "IMP",   RTN  }, { BASIC, "IMR",   '.'  }, { BASIC, "IMRP",  'm'  },
+
+    // With the Thumb
+    { THUMB, "",      ' '  }, { THUMB, "P",     'h'  }, { THUMB, "R",     'k'  },
+    { THUMB, "RP",    'j'  }, { THUMB, "M",     'c'  }, { THUMB, "MP",    'z'  },
+    { THUMB, "MR",    'y'  }, { THUMB, "MRP",   'x'  }, { THUMB, "I",     'i'  },
+    { THUMB, "IP",    'l'  }, { THUMB, "IR",    'r'  }, { THUMB, "IRP",   'w'  },
+    { THUMB, "IM",    'd'  }, { THUMB, "IMP",   '\'' }, { THUMB, "IMR",   'f'  },
+    { THUMB, "IMRP",  'p'  },
+
+    // With Num (or Thumb, when Num is locked)
+    { NUMBR, "",      '1'  }, { NUMBR, "P",     '6'  }, { NUMBR, "R",     '$'  },
+    { NUMBR, "RP",    '7'  }, { NUMBR, "M",     '0'  }, { NUMBR, "MP",    KPE  },
+    { NUMBR, "MR",    '#'  }, { NUMBR, "MRP",   '8'  }, { NUMBR, "I",     '2'  },
+    { NUMBR, "IP",    GBP  }, { NUMBR, "IR",    '+'  }, { NUMBR, "IRP",   '9'  },
+    { NUMBR, "IM",    '3'  }, { NUMBR, "IMP",   '-'  }, { NUMBR, "IMR",   '4'  },
+    { NUMBR, "IMRP",  '5'  },
+
+    // Fingers alone, in Num-shift
+    { NSHFT, "P",     '_'  }, { NSHFT, "R",     '['  }, { NSHFT, "RP",    '>'  },
+    { NSHFT, "M",     '('  }, { NSHFT, "MP",    '/'  }, { NSHFT, "MR",    '-'  },
+    { NSHFT, "MRP",   '{'  }, { NSHFT, "I",     '='  }, { NSHFT, "IP",    '!'  },
+    { NSHFT, "IR",    TAB  }, { NSHFT, "IRP",   ','  }, { NSHFT, "IM",    '+'  },
+    { NSHFT, "IMP",   RTN  }, { NSHFT, "IMR",   '.'  }, { NSHFT, "IMRP",  '*'  },
+
+    // Fingers alone, in e-Shift
+    { ESHFT, "P",     '^'  }, { ESHFT, "R",     ']'  }, { ESHFT, "RP",    '<'  },
+    { ESHFT, "M",     ')'  }, { ESHFT, "MP",    '\\' }, { ESHFT, "MR",    '~'  },
+    { ESHFT, "MRP",   '}'  }, { ESHFT, "I",     F11  }, { ESHFT, "IP",    '|'  },
+    { ESHFT, "IR",    F12  }, { ESHFT, "IRP",   ';'  }, { ESHFT, "IM",    '@'  },
+    { ESHFT, "IMP",   RTN  }, { ESHFT, "IMR",   ':'  }, { ESHFT, "IMRP",  A_C  },
+
+    // With the Thumb, in e-Shift
+    { ETHMB, "",      F01  }, { ETHMB, "P",     F06  }, { ETHMB, "R",     '&'  },
+    { ETHMB, "RP",    F07  }, { ETHMB, "M",     F10  }, { ETHMB, "MP",    '%'  },
+    { ETHMB, "MR",    '?'  }, { ETHMB, "MRP",   F08  }, { ETHMB, "I",     F02  },
+    { ETHMB, "IP",    CER  }, { ETHMB, "IR",    '-'  }, { ETHMB, "IRP",   F09  },
+    { ETHMB, "IM",    F03  }, { ETHMB, "IMP",   '"'  }, { ETHMB, "IMR",   F04  },
+    { ETHMB, "IMRP",  F05  },
+
+    // "Command" codes - with Caps (or the left Thumb, in the two-handed build)
+    { CMD  , "P",     HOM  }, { CMD  , "R",     BCK  }, { CMD  , "RP",    DND  },
+    { CMD  , "M",     KPE  }, { CMD  , "MP",    DWN  }, { CMD  , "MR",    PDN  },
+    { CMD  , "MRP",   _EC  }, { CMD  , "I",     BSP  }, { CMD  , "IP",    ALT  },
+    { CMD  , "IR",    TAB  }, { CMD  , "IRP",   DEL  }, { CMD  , "IM",    BSP  },
+    { CMD  , "IMP",   _UP  }, { CMD  , "IMR",   FWD  }, { CMD  , "IMRP",  PUP  },
+
+    // "Countermand" codes - with Num and Caps, or Num in e-Shift
+    { CNTRC, "RP",    HOM  }, { CNTRC, "MP",    _UP  }, { CNTRC, "MR",    PUP  },
+    { CNTRC, "MRP",   WN2  }, { CNTRC, "I",     INS  }, { CNTRC, "IP",    CTR  },
+    { CNTRC, "IRP",   WIN  }, { CNTRC, "IM",    DEL  }, { CNTRC, "IMR",   BCK  },
+    { CNTRC, "IMRP",  MCL  },
+};
+
+constexpr int NUM_DEFS = sizeof (layout) / sizeof (layout [0]);
+
+/* The multi-stroke prefixes. A prefix is a chord of the modifier keys alone,
+ * which sets up a sub-layer for the chords that follow it. It is either
+ * transient (for the next chord only) or locking (given twice it stays on,
+ * a third time it goes off). While a prefix is on, it routes the chords with
+ * the modifiers it lists to its own layer, and a transient one is then used
+ * up. Other chords go on to the next prefix that is on, and then to the
+ * plain routes below. New multi-stroke layers are added here, as data.
+ *
+ * The decoder state is how far each prefix is on, so the decode table holds
+ * every combination of them. The first prefix listed takes precedence. */
+struct route
+{
+    uint8_t mods;  // the modifier keys with the fingers
+    layer   lyr;   // which layer they pick
+    bool    upper; // send letters in upper case
+};
+
+constexpr int MAX_ROUTES = 3;
+
+struct prefix_def
+{
+    uint8_t chord;  // the modifier keys that set it, with no fingers
+    bool    lock;   // can it be locked on, or is it only transient
+    int     num_routes;
+    route   routes [MAX_ROUTES];
+};
+
+constexpr prefix_def prefixes [] = {
+    // e-Shift - Num and Caps together, transient only
+    { NUM_BIT | CAPS_BIT,  false, 3, { { 0, ESHFT, false }, { THUMB_BIT, ETHMB, false }, { NUM_BIT, CNTRC, false } } },
+    // Num shift - Thumb and Num together
+    { THUMB_BIT | NUM_BIT, true,  2, { { 0, NSHFT, false }, { THUMB_BIT, NUMBR, false } } },
+    // Caps shift - Caps on its own
+    { CAPS_BIT,            true,  2, { { 0, BASIC, true  }, { THUMB_BIT, THUMB, true  } } },
+};
+
+constexpr int NUM_PREFIXES = sizeof (prefixes) / sizeof (prefixes [0]);
+
+// Where chords go with no prefix to route them
+constexpr route plain_routes [] = {
+    { 0,                  BASIC, false },
+    { THUMB_BIT,          THUMB, false },
+    { NUM_BIT,            NUMBR, false },
+    { CAPS_BIT,           CMD,   false }, // "Command" codes
+    { NUM_BIT | CAPS_BIT, CNTRC, false }, // "Countermand" codes
+};
+
+// Thumb and Caps together, with no fingers, turns all the prefixes off
+constexpr uint8_t CLEAR_CHORD = THUMB_BIT | CAPS_BIT;
+
+// The finger key bits for a chord, or -1 if it is badly written
+constexpr int finger_bits (const char *fingers)
+{
+    int bits = 0;
+    for (; *fingers; ++fingers)
+    {
+        const char ff = *fingers;
+        const int bit = (ff == 'P') ? 0x01 : (ff == 'R') ? 0x02 : (ff == 'M') ? 0x04 : (ff == 'I') ? 0x08 : 0;
+        if ((bit == 0) || (bits & bit))
+        {
+            return -1; // not a finger, or the same one twice
+        }
+        bits |= bit;
+    }
+    return bits;
+} // finger_bits
+
+// Does the decoder ever look this chord up? With no fingers pressed, the
+// modifier keys of a prefix (or the clear chord) change the state instead.
+constexpr bool is_prefix (int bits)
+{
+    for (const prefix_def &pfx : prefixes)
+    {
+        if (pfx.chord == bits)
+        {
+            return true;
+        }
+    }
+    return (bits == 0) || (bits == CLEAR_CHORD);
+} // is_prefix
+
+// Can this route pick the chord? It must go to the chord's layer, and with
+// no fingers, its modifier keys must not be taken as a prefix instead.
+constexpr bool route_reaches (const route &rt, layer lyr, int fset)
+{
+    return (rt.lyr == lyr) && ((fset != 0) || !is_prefix (rt.mods));
+} // route_reaches
+
+// Does some route, plain or through a prefix, pick this chord?
+constexpr bool reachable (layer lyr, int fset)
+{
+    for (const route &rt : plain_routes)
+    {
+        if (route_reaches (rt, lyr, fset))
+        {
+            return true;
+        }
+    }
+    for (const prefix_def &pfx : prefixes)
+    {
+        for (int rr = 0; rr < pfx.num_routes; ++rr)
+        {
+            if (route_reaches (pfx.routes [rr], lyr, fset))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+} // reachable
+
+// Checks on the layout - each gives the index of the first bad entry, or -1
+constexpr int bad_chord (void)
+{
+    for (int idx = 0; idx < NUM_DEFS; ++idx)
+    {
+        if ((finger_bits (layout [idx].fingers) < 0) || (layout [idx].lyr >= NUM_LAYERS))
+        {
+            return idx;
+        }
+    }
+    return -1;
+} // bad_chord
+
+constexpr int duplicate_chord (void)
+{
+    for (int idx = 0; idx < NUM_DEFS; ++idx)
+    {
+        for (int other = idx + 1; other < NUM_DEFS; ++other)
+        {
+            if ((layout [idx].lyr == layout [other].lyr) &&
+                (finger_bits (layout [idx].fingers) == finger_bits (layout [other].fingers)))
+            {
+                return other;
+            }
+        }
+    }
+    return -1;
+} // duplicate_chord
+
+constexpr int unreachable_chord (void)
+{
+    for (int idx = 0; idx < NUM_DEFS; ++idx)
+    {
+        if (!reachable (layout [idx].lyr, finger_bits (layout [idx].fingers)))
+        {
+            return idx;
+        }
+    }
+    return -1;
+} // unreachable_chord
+
+static_assert (bad_chord () < 0, "layout: a chord is not made of I, M, R, P (once each), or has no layer");
+static_assert (duplicate_chord () < 0, "layout: the same chord is defined twice in a layer");
+static_assert (unreachable_chord () < 0, "layout: a chord the decoder can never reach");
+
+// The layout as a table for each layer, indexed by the finger keys
+struct layer_tab
+{
+    uint8_t codes [NUM_LAYERS][16];
+};
+
+constexpr layer_tab make_layers (void)
+{
+    layer_tab tab {};
+    for (int idx = 0; idx < NUM_DEFS; ++idx)
+    {
+        tab.codes [layout [idx].lyr][finger_bits (layout [idx].fingers)] = layout [idx].code;
+    }
+    return tab;
+} // make_layers
+
+constexpr layer_tab layers = make_layers ();
+
+// Used to simplify handling shift states on basic ASCII codes
+constexpr uint8_t make_upper (uint8_t cc)
+{
+    return ((cc >= 'a') && (cc <= 'z')) ? (uint8_t)(cc - 'a' + 'A') : cc;
+} // make_upper
+
+// How many states a prefix can be in - off, on, and maybe locked
+constexpr int prefix_levels (const prefix_def &pfx)
+{
+    return pfx.lock ? 3 : 2;
+} // prefix_levels
+
+// The decode table state for a set of prefix levels - the last prefix is the
+// least significant, to match DEC_STATE() in kb-layout.h
+constexpr int state_index (const int (&level) [NUM_PREFIXES])
+{
+    int state = 0;
+    for (int idx = 0; idx < NUM_PREFIXES; ++idx)
+    {
+        state = (state * prefix_levels (prefixes [idx])) + level [idx];
+    }
+    return state;
+} // state_index
+
+constexpr int prefix_states (void)
+{
+    int states = 1;
+    for (int idx = 0; idx < NUM_PREFIXES; ++idx)
+    {
+        states *= prefix_levels (prefixes [idx]);
+    }
+    return states;
+} // prefix_states
+
+constexpr bool prefixes_ok (void)
+{
+    for (int idx = 0; idx < NUM_PREFIXES; ++idx)
+    {
+        const prefix_def &pfx = prefixes [idx];
+        if ((pfx.chord == 0) || (pfx.chord & ~MODIFIERS_MASK) || (pfx.chord == CLEAR_CHORD) ||
+            (pfx.num_routes < 1) || (pfx.num_routes > MAX_ROUTES))
+        {
+            return false;
+        }
+        for (int other = idx + 1; other < NUM_PREFIXES; ++other)
+        {
+            if (prefixes [other].chord == pfx.chord)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+} // prefixes_ok
+
+static_assert (prefixes_ok (), "prefixes: a prefix chord has fingers, is used twice, or has bad routes");
+static_assert (prefix_states () == DEC_STATES, "prefixes: DEC_STATES does not match the prefix list");
+static_assert (state_index ({ 1, 0, 0 }) == DEC_STATE (0, 0, 1), "prefixes: DEC_STATE does not match the prefix list");
+
+// The code for a chord, sent through a route
+constexpr uint8_t route_code (const route &rt, int fset)
+{
+    const uint8_t cc = layers.codes [rt.lyr][fset];
+    return rt.upper ? make_upper (cc) : cc;
+} // route_code
+
+// Decodes one chord (without Rept) with the given prefix levels, and updates them
+constexpr uint8_t decode (int (&level) [NUM_PREFIXES], int bits)
+{
+    const int Fset = bits & FINGERS_MASK;
+    const int Mods = bits & MODIFIERS_MASK;
+
+    if (bits == 0)
+    {
+        return 0;
+    }
+    if (bits == CLEAR_CHORD)
+    {
+        for (int idx = 0; idx < NUM_PREFIXES; ++idx)
+        {
+            level [idx] = 0;
+        }
+        return 0;
+    }
+
+    // A prefix chord - set it; if already set, then "lock" it; if locked, clear it
+    for (int idx = 0; idx < NUM_PREFIXES; ++idx)
+    {
+        if (bits == prefixes [idx].chord)
+        {
+            if (prefixes [idx].lock)
+            {
+                level [idx] = (level [idx] >= 2) ? 0 : level [idx] + 1;
+            }
+            else
+            {
+                level [idx] = 1;
+            }
+            return 0;
+        }
+    }
+
+    // Otherwise the first prefix that is on, and routes these modifiers, takes it
+    for (int idx = 0; idx < NUM_PREFIXES; ++idx)
+    {
+        if (level [idx] == 0)
+        {
+            continue;
+        }
+        for (int rr = 0; rr < prefixes [idx].num_routes; ++rr)
+        {
+            const route &rt = prefixes [idx].routes [rr];
+            if (rt.mods == Mods)
+            {
+                if (level [idx] == 1)
+                {
+                    level [idx] = 0; // a transient prefix is used up
+                }
+                return route_code (rt, Fset);
+            }
+        }
+    }
+
+    for (const route &rt : plain_routes)
+    {
+        if (rt.mods == Mods)
+        {
+            return route_code (rt, Fset);
+        }
+    }
+    return 0;
+} // decode
+
+// Run decode() over every prefix state and chord, to make the state machine
+constexpr decode_tab make_decode (void)
+{
+    decode_tab tab {};
+    int level [NUM_PREFIXES] = {};
+
+    for (int state = 0; state < DEC_STATES; ++state)
+    {
+        for (int bits = 0; bits < DEC_CHORDS; ++bits)
+        {
+            int next [NUM_PREFIXES] = {};
+            for (int idx = 0; idx < NUM_PREFIXES; ++idx)
+            {
+                next [idx] = level [idx];
+            }
+            decode_ent &ent = tab.ent [state][bits];
+            ent.code = (char)decode (next, bits);
+            ent.next = (uint8_t)state_index (next);
+        }
+
+        // the next set of levels, counting up with the last prefix the fastest
+        for (int idx = NUM_PREFIXES - 1; idx >= 0; --idx)
+        {
+            if (++level [idx] < prefix_levels (prefixes [idx]))
+            {
+                break;
+            }
+            level [idx] = 0;
+        }
+    }
+    return tab;
+} // make_decode
+
+// CRC-32 (as zlib), one byte at a time - the same as bank_crc() in kb-bank.c
+constexpr uint32_t crc_byte (uint32_t crc, uint8_t val)
+{
+    crc ^= val;
+    for (int bit = 0; bit < 8; ++bit)
+    {
+        crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+    }
+    return crc;
+} // crc_byte
+
+// Make the built-in keymap bank. The CRC is taken over the table field by
+// field, in memory order, which is the same as bytewise since it is not padded.
+constexpr kb_keymap make_builtin (void)
+{
+    kb_keymap km {};
+    const char name [] = "built-in";
+
+    km.decode = make_decode ();
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for (int state = 0; state < DEC_STATES; ++state)
+    {
+        for (int bits = 0; bits < DEC_CHORDS; ++bits)
+        {
+            crc = crc_byte (crc, (uint8_t)km.decode.ent [state][bits].code);
+            crc = crc_byte (crc, km.decode.ent [state][bits].next);
+        }
+    }
+
+    km.hdr.magic = KB_BANK_MAGIC;
+    km.hdr.version = KB_BANK_VERSION;
+    km.hdr.size = sizeof (kb_keymap) - sizeof (kb_bank_hdr);
+    km.hdr.crc = ~crc;
+    for (unsigned idx = 0; idx < sizeof (name); ++idx)
+    {
+        km.hdr.name [idx] = name [idx];
+    }
+    return km;
+} // make_builtin
+
+static_assert (sizeof (decode_tab) == (DEC_STATES * DEC_CHORDS * 2), "decode_tab must not be padded");
+static_assert (sizeof (kb_keymap) == (sizeof (kb_bank_hdr) + sizeof (decode_tab)), "kb_keymap must not be padded");
+
+/* The chords across both hands, for the two-handed build (see kb-layout.h).
+ * A route takes the modifier keys on each hand, with the right-hand fingers,
+ * to a layer of the layout above, so its codes are not written out twice.
+ * A few chords of their own follow. Either can be listed in any order, they
+ * are sorted below. */
+struct both_route
+{
+    uint8_t left;  // the left-hand keys, all modifiers
+    uint8_t right; // the right-hand modifier keys, with the fingers
+    layer   lyr;   // which layer the fingers are looked up in
+};
+
+constexpr both_route both_routes [] = {
+    // Left Thumb with right-hand fingers gives the command codes, without needing Caps
+    { THUMB_BIT, 0, CMD },
+};
+
+struct both_def
+{
+    uint8_t     left;    // the left-hand keys, all modifiers
+    uint8_t     right;   // the right-hand modifier keys
+    const char *fingers; // the right-hand finger keys
+    uint8_t     code;
+};
+
+constexpr both_def both_defs [] = {
+    { THUMB_BIT, THUMB_BIT, "", RTN }, // both Thumbs
+};
+
+constexpr int NUM_BOTH_ROUTES = sizeof (both_routes) / sizeof (both_routes [0]);
+constexpr int NUM_BOTH_DEFS = sizeof (both_defs) / sizeof (both_defs [0]);
+
+// Are these the keys of a chord across both hands? Only modifiers on the left,
+// something on each hand, and no Rept, which is handled by keyboard_task()
+constexpr bool both_ok (uint8_t left, uint8_t right, int fset)
+{
+    return (fset >= 0) && ((left & ~MODIFIERS_MASK) == 0) && ((right & ~MODIFIERS_MASK) == 0) &&
+           (left != 0) && ((right | fset) != 0) && (((left | right) & RPT_BIT) == 0);
+} // both_ok
+
+// Checks on the both-hands chords - each gives the index of the first bad one, or -1
+constexpr int bad_both_route (void)
+{
+    for (int idx = 0; idx < NUM_BOTH_ROUTES; ++idx)
+    {
+        const both_route &rt = both_routes [idx];
+        if ((rt.lyr >= NUM_LAYERS) || !both_ok (rt.left, rt.right, FINGERS_MASK))
+        {
+            return idx;
+        }
+    }
+    return -1;
+} // bad_both_route
+
+constexpr int bad_both_def (void)
+{
+    for (int idx = 0; idx < NUM_BOTH_DEFS; ++idx)
+    {
+        const both_def &def = both_defs [idx];
+        if ((def.code == 0) || !both_ok (def.left, def.right, finger_bits (def.fingers)))
+        {
+            return idx;
+        }
+    }
+    return -1;
+} // bad_both_def
+
+static_assert (bad_both_route () < 0, "both hands: a route is badly written, has Rept, only uses one hand, or has no layer");
+static_assert (bad_both_def () < 0, "both hands: a chord is badly written, has Rept, only uses one hand, or has no code");
+
+// How many chords there are, from the routes and the list
+constexpr int count_both (void)
+{
+    int count = NUM_BOTH_DEFS;
+    for (const both_route &rt : both_routes)
+    {
+        for (int fset = 1; fset <= FINGERS_MASK; ++fset)
+        {
+            count += (layers.codes [rt.lyr][fset] != 0) ? 1 : 0;
+        }
+    }
+    return count;
+} // count_both
+
+static_assert (count_both () <= BOTH_MAX, "both hands: too many chords, raise BOTH_MAX");
+
+// All the both-hands chords, in the order they are written
+constexpr both_tab list_both (void)
+{
+    both_tab tab {};
+
+    for (const both_route &rt : both_routes)
+    {
+        for (int fset = 1; fset <= FINGERS_MASK; ++fset)
+        {
+            if (layers.codes [rt.lyr][fset] != 0)
+            {
+                tab.ent [tab.count].bits = (uint16_t)((rt.left << LEFT_SHIFT) | rt.right | fset);
+                tab.ent [tab.count].code = (char)layers.codes [rt.lyr][fset];
+                ++tab.count;
+            }
+        }
+    }
+    for (const both_def &def : both_defs)
+    {
+        tab.ent [tab.count].bits = (uint16_t)((def.left << LEFT_SHIFT) | def.right | finger_bits (def.fingers));
+        tab.ent [tab.count].code = (char)def.code;
+        ++tab.count;
+    }
+    return tab;
+} // list_both
+
+constexpr int duplicate_both (void)
+{
+    const both_tab tab = list_both ();
+    for (uint32_t idx = 0; idx < tab.count; ++idx)
+    {
+        for (uint32_t other = idx + 1; other < tab.count; ++other)
+        {
+            if (tab.ent [idx].bits == tab.ent [other].bits)
+            {
+                return (int)other;
+            }
+        }
+    }
+    return -1;
+} // duplicate_both
+
+static_assert (duplicate_both () < 0, "both hands: the same chord is defined twice");
+
+// Sort the both-hands chords by their bits, for the binary search in decode_both()
+constexpr both_tab make_both (void)
+{
+    both_tab tab = list_both ();
+
+    for (uint32_t idx = 1; idx < tab.count; ++idx)
+    {
+        const chord_code cc = tab.ent [idx];
+        uint32_t pos = idx;
+        while ((pos > 0) && (tab.ent [pos - 1].bits > cc.bits))
+        {
+            tab.ent [pos] = tab.ent [pos - 1];
+            --pos;
+        }
+        tab.ent [pos] = cc;
+    }
+    return tab;
+} // make_both
+
+constexpr bool both_sorted (const both_tab &tab)
+{
+    for (uint32_t idx = 1; idx < tab.count; ++idx)
+    {
+        if (tab.ent [idx - 1].bits >= tab.ent [idx].bits)
+        {
+            return false;
+        }
+    }
+    return true;
+} // both_sorted
+
+static_assert (both_sorted (make_both ()), "both hands: the chord table is not sorted");
+
+} // namespace
+
+// The built-in keymap, built by the compiler, so it is const and goes in flash
+constexpr kb_keymap kb_builtin = make_builtin ();
+
+// The chords across both hands, sorted, also in flash
+constexpr both_tab kb_both = make_both ();
+
+/* End of File */
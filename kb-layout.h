@@ -0,0 +1,194 @@
+/*
+ * Keyboard layout for the Microwriter / CyKey keyboard emulation.
+ *
+ * The layout itself is described in kb-layout.cpp, which compiles it into
+ * the const tables declared here, so they live in flash. Other keymaps can
+ * be loaded into flash as banks, and switched between, see kb-bank.c.
+ */
+
+#ifndef _KB_LAYOUT_H_
+#define _KB_LAYOUT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+// Keyboard mapping and decode tables
+#define FNK (10)  // Base of the "Function Key" range
+#define SPC ' '   // 32 - ASCII space - used to delimit the "private" range
+
+// Internal "private" codes for function keys, etc.
+#define DEL  (1)  // DELETE
+#define _UP  (2)  // Cursor UP
+#define FWD  (3)  // Cursor Forward (RIGHT)
+#define PUP  (4)  // Page UP
+#define INS  (5)  // INSERT
+#define CTR  (6)  // CTRL modifier
+#define KPE  (7)  // Keypad Enter key code
+#define MCL  (8)  // Clear the one-shot and locked modifiers
+#define TAB  '\t' // TAB key (9)
+#define RTN  '\n' // Return key (10)
+
+#define F01  (FNK + 1) // 11
+#define F02  (FNK + 2)
+#define F03  (FNK + 3)
+#define F04  (FNK + 4)
+#define F05  (FNK + 5) // 15
+#define F06  (FNK + 6)
+#define F07  (FNK + 7)
+#define F08  (FNK + 8)
+#define F09  (FNK + 9)
+#define F10  (FNK + 10) // 20
+#define F11  (FNK + 11)
+#define F12  (FNK + 12) // 22
+#define A_C  (23)  // Internal code for A/C - Used to generate Alt+Ctrl+<next key press>
+#define HOM  (24)  // HOME
+#define BCK  (25)  // Cursor BACK (LEFT)
+#define DND  (26)  // Document END
+#define DWN  (27)  // Cursor DOWN
+#define PDN  (28)  // Page DOWN
+#define _EC  (29)  // ESC
+#define BSP  (30)  // 30 - Backspace
+#define ALT  (31)  // 31 - ALT modifier
+
+#define GBP (163) // Old 1252 code for £ sign
+#define CER (128) // Old 1252 code for Euro sign
+#define WIN (129) // WIN key (as a modifier)
+#define WN2 (130) // WIN key (as a key)
+
+/*  The 8 key switches are mapped into a byte as follows:
+    ---------------------------------
+msb | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 | lsb
+    ---------------------------------
+    | R | N | C | T | I | M | R | P |
+    | e | u | a | h | n | i | i | i |
+    | p | m | p | u | d | d | n | n |
+    | t |   | s | m | e |   | g | k |
+    |   |   |   | b | x |   |   | y |
+    ---------------------------------
+*/
+
+#define THUMB_BIT      0x10
+#define CAPS_BIT       0x20
+#define NUM_BIT        0x40
+#define RPT_BIT        0x80
+#define MODIFIERS_MASK 0xF0
+#define FINGERS_MASK   0x0F
+
+/* The decoder is a state machine, over the shift states and the chord.
+ * Each entry of the table gives the code for a chord in a given state, and
+ * the state that follows, so decoding is one lookup, the same for every chord,
+ * and a multi-stroke sequence is one lookup per stroke. The states come from
+ * the list of prefixes in kb-layout.cpp, which must match these.
+ * Rept is handled by keyboard_task(), so it is not in there. */
+#define DEC_STATES 18  // Caps (3) x Num lock (3) x eShift (2)
+#define DEC_CHORDS 128 // all the keys but Rept
+#define DEC_STATE(caps, num, eshft) ((caps) + (3 * (num)) + (9 * (eshft)))
+
+typedef struct
+{
+    char    code; // what the chord decodes to, 0 for nothing
+    uint8_t next; // the shift state after it
+} decode_ent;
+
+typedef struct
+{
+    decode_ent ent [DEC_STATES][DEC_CHORDS];
+} decode_tab;
+
+/* What to send to the host for each decoded code. This depends on the
+ * keyboard layout the host is set to, so there is a table for each host
+ * layout (see kb-host.cpp), picked at run time. */
+#define HOST_US      0
+#define HOST_UK      1
+#define HOST_DE      2
+#define HOST_FR      3
+#define HOST_LAYOUTS 4
+
+#define HC_DEAD 0x01 // a dead key on this host layout, so send a space after it
+
+typedef struct
+{
+    uint8_t mods;    // modifier bits to send with the key
+    uint8_t key;     // the HID key code, 0 if none
+    uint8_t mods_1s; // one-shot modifier bits to add to the next key, 0 if none
+    uint8_t flags;   // HC_xxx
+} hid_code;
+
+typedef struct
+{
+    hid_code code [256];
+} hid_tab;
+
+/* A keymap "bank" - the decode table, with a header so a bank in
+ * flash can be checked before it is used. The built-in keymap is a bank too.
+ * Banks are used in place, straight from flash, never copied. */
+#define KB_BANK_MAGIC   0x4B4D4150 // "PAMK"
+#define KB_BANK_VERSION 3
+#define KB_BANK_NAME    20
+
+typedef struct
+{
+    uint32_t magic;   // KB_BANK_MAGIC
+    uint16_t version; // KB_BANK_VERSION
+    uint16_t size;    // bytes after the header
+    uint32_t crc;     // CRC-32 (as zlib) of the bytes after the header
+    char     name [KB_BANK_NAME];
+} kb_bank_hdr;
+
+typedef struct
+{
+    kb_bank_hdr hdr;
+    decode_tab  decode;
+} kb_keymap;
+
+// The chord that selects a bank: Thumb, Num and Caps together (which are
+// not used otherwise) with the finger keys giving the bank, none for the built-in one
+#define BANK_BITS (THUMB_BIT | NUM_BIT | CAPS_BIT)
+
+/* Chords across both hands, for the two-handed build. With 16 keys there
+ * are 65536 possible chords, far too many for dense tables, and very few of
+ * them are any use. So only the chords that are defined are listed, sorted
+ * by their bits, and looked up with a binary search. No shift states apply. */
+#define LEFT_SHIFT 8 // the left hand keys are [15:8]
+#define BOTH_MAX   32
+
+typedef struct
+{
+    uint16_t bits;  // the whole chord, both hands
+    char     code;  // what it decodes to
+} chord_code;
+
+typedef struct
+{
+    uint32_t   count;
+    chord_code ent [BOTH_MAX];
+} both_tab;
+
+// Defined in kb-layout.cpp
+extern const kb_keymap kb_builtin;
+extern const both_tab kb_both;
+
+// Defined in kb-host.cpp
+extern const hid_tab host_tabs [HOST_LAYOUTS];
+
+// Defined in kb-bank.c
+extern uint32_t bank_init (void);
+extern uint32_t bank_crc (const uint8_t *data, uint32_t len);
+extern bool bank_select (uint32_t bank);
+extern uint32_t bank_current (void);
+extern const kb_keymap *bank_keymap (void);
+extern bool host_select (uint32_t host);
+extern uint32_t host_current (void);
+extern const hid_tab *host_table (void);
+
+#ifdef __cplusplus
+ }
+#endif
+
+#endif /* _KB_LAYOUT_H_ */
+
+/* End of File */
@@ -1,7 +1,7 @@
 /*
  * Entry point for the Microwriter / CyKey keyboard emulation.
  *
- * The key-code tables defined here are based on what my CyKey does and what I can
+ * The key-code tables (see kb-layout.cpp) are based on what my CyKey does and what I can
  * remember (or look up!) about what the original Microwriter actually did.
  *
  * https://en.wikipedia.org/wiki/Microwriter
@@ -26,13 +26,19 @@ msb | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 | lsb
     ---------------------------------
  *
  * Note: GPIO pins 2..9 are used for the 8 bits, since GPIO 0,1 are used for
- * the serial port.
+ * the serial port. Other boards can route the switches to any pins, set by
+ * KB_PIN_MAP in kb-main.h.
  *
- * Note : The layout is not "symmetrical" with 9 keys like the CyKey and so
- * it does not support the mirrored "left-hand" mode that the CyKey has.
- * Though doing so would only need one more key switch and GPIO line, and if
- * "mirror" mode was selected then the keymap could be bit-reversed and shifted
- * down on read to produce the current 8-bit mask. So do-able...
+ * Note : Like the CyKey, there can be a 9th key switch, on GPIO 10, making the
+ * layout "symmetrical" so it can support the mirrored "left-hand" mode. When
+ * "mirror" mode is selected, the 9 switches are bit-reversed on read to
+ * produce the current 8-bit mask (see kb-scan.c), so the same layout tables
+ * serve both hands.
+ *
+ * Note : There is also a two-handed build (KB_TWO_HAND in kb-main.h) with 8
+ * switches on each hand, making a 16-bit chord. Chords on either hand alone
+ * use the same layout tables, chords across both hands have a table of their
+ * own (see decode_chord()).
  *
  */
 
@@ -41,8 +47,9 @@ msb | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 | lsb
 #include "pico/stdlib.h"
 #include "pico/multicore.h"
 #include "pico/unique_id.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
 #include <string.h>
-#include <ctype.h>
 
 // tinyusb parts...
 #include <bsp/board.h>
@@ -50,190 +57,174 @@ msb | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 | lsb
 
 // local parts
 #include "kb-main.h"
+#include "kb-layout.h"
 
 /* Are we emitting serial debug? */
 #define SER_DBG_ON  1  // serial debug on
 //#undef SER_DBG_ON      // serial debug off
 
-// Keyboard mapping and decode tables
-#define FNK (10)  // Base of the "Function Key" range
-#define SPC ' '   // 32 - ASCII space - used to delimit the "private" range
-
-// Internal "private" codes for function keys, etc.
-#define DEL  (1)  // DELETE
-#define _UP  (2)  // Cursor UP
-#define FWD  (3)  // Cursor Forward (RIGHT)
-#define PUP  (4)  // Page UP
-#define INS  (5)  // INSERT
-#define CTR  (6)  // CTRL modifier
-#define KPE  (7)  // Keypad Enter key code
-#define TAB  '\t' // TAB key (9)
-#define RTN  '\n' // Return key (10)
-
-#define F01  (FNK + 1) // 11
-#define F02  (FNK + 2)
-#define F03  (FNK + 3)
-#define F04  (FNK + 4)
-#define F05  (FNK + 5) // 15
-#define F06  (FNK + 6)
-#define F07  (FNK + 7)
-#define F08  (FNK + 8)
-#define F09  (FNK + 9)
-#define F10  (FNK + 10) // 20
-#define F11  (FNK + 11)
-#define F12  (FNK + 12) // 22
-#define A_C  (23)  // Internal code for A/C - Used to generate Alt+Ctrl+<next key press>
-#define HOM  (24)  // HOME
-#define BCK  (25)  // Cursor BACK (LEFT)
-#define DND  (26)  // Document END
-#define DWN  (27)  // Cursor DOWN
-#define PDN  (28)  // Page DOWN
-#define _EC  (29)  // ESC
-#define BSP  (30)  // 30 - Backspace
-#define ALT  (31)  // 31 - ALT modifier
-
-// convert "internal" codes into USB HID keycodes
-static uint8_t const int_codes_table [32] = {
-    0,
-    HID_KEY_DELETE,
-    HID_KEY_ARROW_UP,
-    HID_KEY_ARROW_RIGHT,
-    HID_KEY_PAGE_UP,
-    HID_KEY_INSERT,
-    HID_KEY_CONTROL_LEFT, // Can be a modifier
-    HID_KEY_KEYPAD_ENTER,
-    0, // 8 - unused
-    HID_KEY_TAB,
-    HID_KEY_ENTER,
-    HID_KEY_F1,
-    HID_KEY_F2,
-    HID_KEY_F3,
-    HID_KEY_F4,
-    HID_KEY_F5,
-    HID_KEY_F6,
-    HID_KEY_F7,
-    HID_KEY_F8,
-    HID_KEY_F9,
-    HID_KEY_F10,
-    HID_KEY_F11,
-    HID_KEY_F12,
-    0, // 23 - Alt + Ctrl special modifier "A_C" code
-    HID_KEY_HOME,
-    HID_KEY_ARROW_LEFT,
-    HID_KEY_END,
-    HID_KEY_ARROW_DOWN,
-    HID_KEY_PAGE_DOWN,
-    HID_KEY_ESCAPE,
-    HID_KEY_BACKSPACE,
-    HID_KEY_ALT_LEFT // Can be a modifier
-    };
-
-#define GBP (163) // Old 1252 code for £ sign
-#define CER (128) // Old 1252 code for Euro sign
-#define WIN (129) // WIN key (as a modifier)
-#define WN2 (130) // WIN key (as a key)
-
-/*  The 8 key switches are mapped into a byte as follows:
-    ---------------------------------
-msb | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 | lsb
-    ---------------------------------
-    | R | N | C | T | I | M | R | P |
-    | e | u | a | h | n | i | i | i |
-    | p | m | p | u | d | d | n | n |
-    | t |   | s | m | e |   | g | k |
-    |   |   |   | b | x |   |   | y |
-    ---------------------------------
-*/
-
-#define THUMB_BIT      0x10
-#define CAPS_BIT       0x20
-#define NUM_BIT        0x40
-#define RPT_BIT        0x80
-#define MODIFIERS_MASK 0xF0
-#define FINGERS_MASK   0x0F
-
-// The tinyusb ASCII -> HID code table
-static uint8_t const conv_table[128][2] =  { HID_ASCII_TO_KEYCODE };
-
-// Lookup tables for the basic finger keys (not thumb) in each "shift" state
-// The basic codes for the 4 "finger" keys
-static char basic_codes [16] = { 0 , 'u', 's', 'g',
-                                'o', 'q', 'n', 'b',
-                                'e', 'v', 't', ',',
-                                'a', RTN, '.', 'm'};
-// With the Thumb modifier
-static char thumb_codes [16] = {' ', 'h', 'k', 'j',
-                                'c', 'z', 'y', 'x',
-                                'i', 'l', 'r', 'w',
-                                'd','\'', 'f', 'p'};
-// With the Num modifier
-static char numbr_codes [16] = {'1', '6', '$', '7',
-                                '0', KPE, '#', '8',
-                                '2', GBP, '+', '9',
-                                '3', '-', '4', '5'};
-// With the Num-shift modifier
-static char nShft_codes [16] = { 0 , '_', '[', '>',
-                                '(', '/', '-', '{',
-                                '=', '!', TAB, ',',
-                                '+', RTN, '.', '*'};
-// With the e-Shift modifier
-static char eShft_codes [16] = { 0 , '^', ']', '<',
-                                ')','\\', '~', '}',
-                                F11, '|', F12, ';',
-                                '@', RTN, ':', A_C};
-
-// With the e-Shift Thumb modifier
-static char eThmb_codes [16] = {F01, F06, '&', F07,
-                                F10, '%', '?', F08,
-                                F02, CER, '-', F09,
-                                F03, '"', F04, F05};
-// "Command" codes
-static char cmd_codes [16]   = { 0 , HOM, BCK, DND,
-                                KPE, DWN, PDN, _EC,
-                                BSP, ALT, TAB, DEL,
-                                BSP, _UP, FWD, PUP};
-// "Countermand" codes
-static char cntrc_codes [16] = { 0 ,  0 ,  0 , HOM,
-                                 0 , _UP, PUP, WN2,
-                                INS, CTR,  0 , WIN,
-                                DEL,  0 , BCK,  0 };
-
 #ifdef SER_DBG_ON
 // enable additional serial i/o chatter
 static int verbose_debug = 0;
 #endif // SER_DBG_ON
 
-// circular buffer for key-codes, pending sending...
-#define KC_SZ 8
+// How often main() wakes to poll, if no interrupt wakes it first
+#define IDLE_WAKE_MS 1
+
+/* Queue of key reports, pending sending...
+ * Each is flagged if it is the last of its sequence, so hid_task() knows
+ * to release all the keys before it starts on the next one.
+ * Filled by msg_task() and rpt_task(), emptied by hid_task() and the HID
+ * complete callback, all on core-0. One side may be the FIFO interrupt, so
+ * each index is written by one side only, and the indices run freely (masked
+ * on use), so in - out is always the number waiting. Nothing should ever be
+ * dropped, as msg_task() only takes a frame when there is room for it all,
+ * leaving core-1 to wait, but any that are, are counted. */
 #define KC_MSK (KC_SZ - 1)
-static uint32_t kc_buf [KC_SZ];
-static uint32_t kc_in  = 0;
-static uint32_t kc_out = 0;
 
-// Used by main() to queue up payloads for sending to the USB hid_task()
-static void kc_put (uint32_t uv)
+#if (KC_SZ & KC_MSK)
+#error "KC_SZ must be a power of 2"
+#endif
+#if (KC_SZ < MSG_SEQ_MAX)
+#error "KC_SZ must hold the longest frame, MSG_SEQ_MAX"
+#endif
+
+static kb_report *kc_buf [KC_SZ];
+static bool kc_last [KC_SZ];
+static volatile uint32_t kc_in  = 0;
+static volatile uint32_t kc_out = 0;
+static uint32_t kc_high = 0;  // the most reports ever waiting
+static volatile uint32_t kc_dropped = 0;
+
+// Used by main() to queue up reports for sending to the USB hid_task()
+// Returns false if the queue is full, and the report is dropped.
+static bool kc_put (kb_report *rpt, bool last)
 {
-    uint32_t next = (kc_in + 1) & KC_MSK;
-    if (next == kc_out)
+    const uint32_t in = kc_in;
+    const uint32_t used = in - kc_out;
+
+    if (used >= KC_SZ)
     {
         // queue full, skip this character
-        return;
+        ++kc_dropped;
+        return false;
     }
-    kc_buf [kc_in] = uv;
-    kc_in = next;
-}
+    report_hold (rpt); // let go by hid_task() once it is sent
+    kc_buf [in & KC_MSK] = rpt;
+    kc_last [in & KC_MSK] = last;
+    __dmb (); // the entry must be written before it is counted in
+    kc_in = in + 1;
+    if (used >= kc_high)
+    {
+        kc_high = used + 1;
+    }
+    return true;
+} // kc_put
+
+// How many more reports will fit in the buffer?
+static uint32_t kc_room (void)
+{
+    return KC_SZ - (kc_in - kc_out);
+} // kc_room
 
-// Used by hid_task() in usb-stack.c to read payloads to send on the USB
-uint32_t kc_get (void)
+// Used by hid_task() in usb-stack.c to read reports to send on the USB
+kb_report *kc_get (bool *last)
 {
-    if (kc_in == kc_out)
+    const uint32_t out = kc_out;
+
+    if (out == kc_in)
     {
-        return 0;
+        return NULL;
     }
-    uint32_t uv = kc_buf [kc_out];
-    kc_out = (kc_out + 1) & KC_MSK;
-    return uv;
-}
+    __dmb (); // read the entry only after seeing the index that covers it
+    kb_report *rpt = kc_buf [out & KC_MSK];
+    *last = kc_last [out & KC_MSK];
+    __dmb ();
+    kc_out = out + 1;
+    return rpt;
+} // kc_get
+
+// Is anything waiting to be sent?
+bool kc_waiting (void)
+{
+    return (kc_in != kc_out);
+} // kc_waiting
+
+// The most reports that have been waiting to be sent at once
+uint32_t kc_high_water (void)
+{
+    return kc_high;
+} // kc_high_water
+
+// How many reports have been lost because the queue was full
+uint32_t kc_drops (void)
+{
+    return kc_dropped;
+} // kc_drops
+
+/* Typematic repeat, for the Rept key. This runs on core-0.
+ * When core-1 sends MSG_RPT_ON, the last key sent is repeated - its whole
+ * frame, so a dead key still gets its space after it - first after
+ * rpt_delay_us then every rpt_period_us, until MSG_RPT_OFF or another key
+ * arrives. The alarm only marks a repeat as due; rpt_task() queues it once
+ * the previous key has been released on the USB, so repeats never pile up
+ * in kc_buf - if the host cannot keep up, repeats are skipped, not queued. */
+static volatile uint32_t rpt_delay_us  = RPT_DELAY_MS * 1000;
+static volatile uint32_t rpt_period_us = 1000000 / RPT_RATE_HZ;
+
+static kb_report *rpt_keys [MSG_SEQ_MAX]; // the last frame of key reports sent, held for repeating
+static uint32_t rpt_count = 0;
+static alarm_id_t rpt_alarm = 0;   // the repeat alarm, 0 when not repeating
+static volatile bool rpt_due = false;
+
+// Repeat alarm handler - runs on core-0, from the default alarm pool
+static int64_t rpt_alarm_cb (alarm_id_t id, void *user_data)
+{
+    rpt_due = true;
+    return rpt_period_us; // positive, so timed from when this one was due - no drift
+} // rpt_alarm_cb
+
+static void rpt_stop (void)
+{
+    if (rpt_alarm > 0)
+    {
+        cancel_alarm (rpt_alarm);
+    }
+    rpt_alarm = 0;
+    rpt_due = false;
+} // rpt_stop
+
+static void rpt_start (void)
+{
+    rpt_stop ();
+    if (rpt_count)
+    {
+        rpt_alarm = add_alarm_in_us (rpt_delay_us, rpt_alarm_cb, NULL, true);
+    }
+} // rpt_start
+
+// Queue the next repeat, once it is due and the last one has gone
+static void rpt_task (void)
+{
+    uint32_t idx;
+
+    if ((rpt_due) && (kc_in == kc_out) && (hid_key_idle ()))
+    {
+        rpt_due = false;
+        for (idx = 0; idx < rpt_count; ++idx)
+        {
+            kc_put (rpt_keys [idx], (idx + 1) == rpt_count);
+        }
+    }
+} // rpt_task
+
+// Set the typematic delay and rate at runtime
+void rpt_set_rate (uint32_t delay_ms, uint32_t rate_hz)
+{
+    if (rate_hz == 0) return; // nonsense, ignore it
+    rpt_delay_us = delay_ms * 1000;
+    rpt_period_us = 1000000 / rate_hz;
+} // rpt_set_rate
 
 #ifdef SER_DBG_ON
 // Testing support - make each sequence into printable ASCII for debug
@@ -270,283 +261,354 @@ static char make_printable (const unsigned char cc)
 } // make_printable
 #endif // SER_DBG_ON
 
-// Used to track whether a local shift (caps lock, basically) is currently in force
-static unsigned char LCL_SHFT = 0;
-
-// Compose key sequences into USB HID keyboard payloads.
-// This runs as a worker thread on the second core of the pico (core-1)
-static void make_usb_key (const unsigned char cc)
+#ifdef SER_DBG_ON
+// Testing support - dump the key edges logged by the scanner
+static void show_edges (void)
 {
-    uint8_t Mods = 0;
-    uint8_t Kcode = 0;
-    uint8_t start_mods = 0;
-    static uint8_t pending_mods = 0;
-    msg_blk code;
-    code.u_msg = 0;
-
-    if (cc < SPC)
+    key_edge edge;
+    while (scan_get_edge (&edge))
     {
-        // Some sort of internal key - determine which...
-        Kcode = int_codes_table [cc];
+        printf ("\n  key %d %s at %lu", edge.key, edge.down ? "down" : "up", (unsigned long)edge.time_us);
+    }
+} // show_edges
+#endif // SER_DBG_ON
+
+// Report slots whose frame could not be queued, kept for the next keys
+static kb_report *spare_reports [MSG_SEQ_MAX];
+static uint32_t spare_count = 0;
+
+// Get slots to build the next key reports in, all of them or none
+static bool get_reports (kb_report **rpts, uint32_t count)
+{
+    uint32_t idx;
 
-        if ((Kcode == HID_KEY_CONTROL_LEFT) || (Kcode == HID_KEY_ALT_LEFT) || (cc == A_C))
+    for (idx = 0; idx < count; ++idx)
+    {
+        if (spare_count)
         {
-            // Start a modifier sequence
-            if (Kcode)
-            {
-                start_mods = Kcode;
-                Kcode = 0;
-            }
-            else
-            {
-                start_mods = A_C;
-            }
+            rpts [idx] = spare_reports [--spare_count];
         }
-    }
-    else if (cc < 128)
-    {
-        if (conv_table[cc][0])
+        else if ((rpts [idx] = report_alloc ()) == NULL)
         {
-            Mods = KEYBOARD_MODIFIER_LEFTSHIFT;
+            while (idx > 0)
+            {
+                spare_reports [spare_count++] = rpts [--idx];
+            }
+            return false;
         }
-        Kcode = conv_table[cc][1];
-    }
-    else if (cc == CER) // Euro symbol €
-    {
-        Mods = HID_KEY_ALT_RIGHT;
-        Kcode = HID_KEY_4; // AlrGr + 4 works for UK layouts...
-    }
-    else if (cc == GBP) // GBP symbol $
-    {
-        Mods = KEYBOARD_MODIFIER_LEFTSHIFT;
-        Kcode = HID_KEY_3; // Shift-3 is correct for UK layouts
+        memset (rpts [idx], 0, sizeof (kb_report));
     }
-    else if (cc == WIN) // This is WIN as a modifier
+    return true;
+} // get_reports
+
+/* Pass a sequence of report states, built in their slots, to the main thread
+ * on core-0 as one frame, for sending one after the other, followed by a
+ * release of all keys. Returns false if it could not be queued. */
+static bool send_seq (kb_report *const *rpts, uint32_t count)
+{
+    key_msg msgs [MSG_SEQ_MAX];
+    uint32_t now = time_us_32 ();
+    uint32_t idx;
+
+    for (idx = 0; idx < count; ++idx)
     {
-        // Mods = KEYBOARD_MODIFIER_LEFTGUI;
-        Kcode = 0;
-        start_mods = HID_KEY_GUI_LEFT;
+        msgs [idx].time_us = now;
+        msgs [idx].report = rpts [idx];
+        msgs [idx].flags = 0;
+        msgs [idx].cmd = 0;
     }
-    else if (cc == WN2) // This is WIN as a key on its own
+
+    if (!msg_put (msgs, count))
     {
-        Mods = KEYBOARD_MODIFIER_LEFTGUI;
-        Kcode = HID_KEY_GUI_LEFT;
+        // dropped - core-0 never saw these slots, so they are still ours
+        while (count > 0)
+        {
+            spare_reports [spare_count++] = rpts [--count];
+        }
+        return false;
     }
+    return true;
+} // send_seq
+
+// Pass a control message to the main thread on core-0
+static void send_ctl (uint8_t cmd)
+{
+    key_msg msg;
+    msg.time_us = time_us_32 ();
+    msg.report = NULL;
+    msg.flags = MSG_F_CTL;
+    msg.cmd = cmd;
+    msg_put (&msg, 1);
+} // send_ctl
+
+// The keymap for the chord being decoded, core-1's copy of bank_keymap()
+static const kb_keymap *cur_map = &kb_builtin;
+
+// The host layout for the chord being decoded, core-1's copy of host_table()
+static const hid_tab *cur_host = &host_tabs [KB_HOST_LAYOUT];
+
+/* The one-shot modifiers, as HID modifier bits, so any mix of the eight can
+ * be built up. Like the Caps and Num shifts, a modifier chord "latches" its
+ * modifiers for the next key; the same chord again "locks" them, for every
+ * key until the third time, or the MCL chord clears them all. */
+static uint8_t mods_latched = 0;
+static uint8_t mods_locked = 0;
+
+// Apply a modifier chord, bit by bit: set, then lock, then clear
+static void add_mods (const uint8_t mods)
+{
+    const uint8_t unlock = mods & mods_locked;
+    const uint8_t lock = mods & mods_latched & ~mods_locked;
+    const uint8_t latch = mods & ~(mods_latched | mods_locked);
+
+    mods_locked = (mods_locked & ~unlock) | lock;
+    mods_latched = (mods_latched & ~lock) | latch;
+} // add_mods
+
+// Compose key sequences into USB HID keyboard reports.
+// This runs as a worker thread on the second core of the pico (core-1)
+// Returns true if a key press was sent, false if not (e.g. just a modifier)
+static bool make_usb_key (const unsigned char cc)
+{
+    // what to send for this code - precomputed for the host layout
+    const hid_code *hc = &cur_host->code [cc];
 
-    if (start_mods)
+    if (cc == MCL)
     {
-        pending_mods = start_mods;
-        Kcode = 0;  // ensure nothing is sent this cycle
+        mods_latched = 0;
+        mods_locked = 0;
+        return false;
     }
-    else if (pending_mods)
+
+    if (hc->mods_1s)
     {
-        if (pending_mods == A_C)
-        {
-            code.p[3] = KEYBOARD_MODIFIER_LEFTCTRL | KEYBOARD_MODIFIER_LEFTALT;
-            code.p[2] = HID_KEY_CONTROL_LEFT;
-            code.p[1] = HID_KEY_ALT_LEFT;
-            code.p[0] = Kcode;
-        }
-        else if (pending_mods == HID_KEY_CONTROL_LEFT)
-        {
-            code.p[3] = KEYBOARD_MODIFIER_LEFTCTRL;
-            code.p[2] = HID_KEY_CONTROL_LEFT;
-            code.p[1] = Kcode;
-        }
-        else if (pending_mods == HID_KEY_ALT_LEFT)
-        {
-            code.p[3] = KEYBOARD_MODIFIER_LEFTALT;
-            code.p[2] = HID_KEY_ALT_LEFT;
-            code.p[1] = Kcode;
-        }
-        else if (pending_mods == HID_KEY_GUI_LEFT)
-        {
-            code.p[3] = KEYBOARD_MODIFIER_LEFTGUI;
-            code.p[2] = HID_KEY_GUI_LEFT;
-            code.p[1] = Kcode;
-        }
-        pending_mods = 0;
+        add_mods (hc->mods_1s);
+        return false; // ensure nothing is sent this cycle
     }
-    else // send the current key
+
+    if (hc->key == 0)
     {
-        code.p[3] = Mods;
-        code.p[2] = Kcode;
+        return false; // the host layout has no key for it - nothing typed, so keep any latched modifiers
     }
 
-    // If there is a key press ready, pass it to the main thread for processing / sending
-    if (Kcode)
+    // A dead key on the host only types its character with a space after it
+    const uint8_t mods = hc->mods | mods_latched | mods_locked;
+    const uint32_t count = (hc->flags & HC_DEAD) ? 3 : 1;
+    kb_report *rpts [3];
+    mods_latched = 0;
+    if (!get_reports (rpts, count))
     {
-        if (multicore_fifo_wready ())
-        {
-            multicore_fifo_push_blocking (code.u_msg);
-        }
+        return false;
     }
-} // make_usb_key
 
-// Used to simplify handling shift states on basic ASCII codes
-static char make_upper (const char cc)
-{
-    char cr = cc;
-    if ((cr >= 'a') && (cr <= 'z'))
+    // The key goes with all the modifiers in the one report
+    rpts[0]->mods = mods;
+    rpts[0]->keys[0] = hc->key;
+    if (count == 3)
     {
-        cr = toupper (cr);
+        rpts[2]->keys[0] = HID_KEY_SPACE; // rpts[1] releases the dead key
     }
-    return cr;
-} // make_upper
 
-static unsigned char CAPS = 0;   // 0 = OFF, 1 - transient, 2 - Lock
-static unsigned char NUM_LK = 0; // 0 = OFF, 1 - transient, 2 - Lock
-static unsigned char SHFTE  = 0; // 0 = OFF, 1 - transient, does not lock
+    // pass it to the main thread for sending
+    return send_seq (rpts, count);
+} // make_usb_key
+
+// The decoder's shift state, see kb-layout.h
+static uint8_t dec_state = DEC_STATE (0, 0, 0);
 
-// Decodes the key combinations into something like ASCII we can use for the USB HID messages
-static char decode_bits (const unsigned char bits)
+// Decodes a chord, and moves on to the next shift state
+static char decode_bits (const chord_rec *chord)
 {
-    const unsigned char Fset = bits & FINGERS_MASK;
-    const unsigned char Mods = bits & MODIFIERS_MASK;
+    const unsigned char bits = chord->bits & (DEC_CHORDS - 1); // Rept is handled by keyboard_task()
+    const decode_ent ent = cur_map->decode.ent [dec_state][bits];
 
 #ifdef SER_DBG_ON
     if (verbose_debug)
     {
-        printf ("\n0x%02X - 0x%02X 0x%02X (%d, %d, %d) -- ", bits, Mods, Fset, CAPS, NUM_LK, SHFTE);
+        printf ("\n0x%02X - state %d -> %d peak 0x%02X first %d held %luus -- ",
+                bits, dec_state, ent.next, (unsigned)chord->peak, chord->first, (unsigned long)chord->hold_us);
     }
 #endif // SER_DBG_ON
 
-    if ((Mods == 0) && (Fset)) // no modifier bits are set, but some keys are pressed
+    dec_state = ent.next;
+    return ent.code;
+} // decode_bits
+
+#if (KB_TWO_HAND)
+// Look up a chord across both hands, in the sorted table from kb-layout.cpp
+static char decode_both (uint32_t bits)
+{
+    int lo = 0;
+    int hi = (int)kb_both.count - 1;
+
+    while (lo <= hi)
     {
-        if (SHFTE)
+        int mid = (lo + hi) / 2;
+        if (kb_both.ent [mid].bits == bits)
         {
-            SHFTE = 0; // clear a transient SHFTE eShift
-            return eShft_codes [Fset];
+            return kb_both.ent [mid].code;
         }
-        if (NUM_LK)
+        if (kb_both.ent [mid].bits < bits)
         {
-            if (NUM_LK == 1) NUM_LK = 0; // clear a transient NUM_LK Shift
-            return nShft_codes [Fset];
+            lo = mid + 1;
         }
-        if (CAPS)
+        else
         {
-            if (CAPS == 1) CAPS = 0; // clear a transient Caps Shift
-            return make_upper (basic_codes [Fset]);
+            hi = mid - 1;
         }
-        return basic_codes [Fset];
     }
-    else if (Mods == THUMB_BIT) // Thumb is the only modifier set
+    return 0; // not a defined chord
+} // decode_both
+#endif // KB_TWO_HAND
+
+// Decode a chord - in the two-handed build, sort out which hands were used first
+static char decode_chord (const chord_rec *chord)
+{
+#if (KB_TWO_HAND)
+    const uint32_t right = chord->bits & 0xFF;
+    const uint32_t left  = (chord->bits >> LEFT_SHIFT) & 0xFF;
+
+    if ((right & ~RPT_BIT) && (left & ~RPT_BIT))
     {
-        if (SHFTE)
-        {
-            SHFTE = 0; // clear a transient SHFTE Shift
-            return eThmb_codes [Fset];
-        }
-        if (NUM_LK)
-        {
-            if (NUM_LK == 1) NUM_LK = 0; // clear a transient NUM_LK Shift
-            return numbr_codes [Fset];
-        }
-        if (CAPS)
-        {
-            if (CAPS == 1) CAPS = 0; // clear a transient Caps Shift
-            return make_upper (thumb_codes [Fset]);
-        }
-        return thumb_codes [Fset];
+        return decode_both (chord->bits & ~KB_HOLD_KEYS); // Rept is handled by keyboard_task()
     }
-    else if (Mods == NUM_BIT) // Numbers is the only modifier set
+
+    // One hand (perhaps with Rept on the other) - fold it onto the one-hand layout
+    chord_rec one = *chord;
+    one.bits = right | left;
+    return decode_bits (&one);
+#else
+    return decode_bits (chord);
+#endif // KB_TWO_HAND
+} // decode_chord
+
+/* The "main" task on the second core.
+ * This manages the reading and initial decoding of the keyboard matrix. */
+void keyboard_task (void)
+{
+    // hook the key switch scanner up to this core
+    scan_init ();
+
+    // signal to the primary thread that this worker thread is ready
+    multicore_fifo_push_blocking (99);
+
+    // Forever - wait for each complete chord, then decode it.
+    while (true)
     {
-        if (SHFTE)
+        // The OR of all the keys pressed, returned once ALL keys are released
+        chord_rec chord;
+        scan_get_chord (&chord);
+
+#ifdef SER_DBG_ON
+        if (verbose_debug)
         {
-            SHFTE = 0; // clear a transient SHFTE Shift
-            //return eThmb_codes [Fset];
-            return cntrc_codes [Fset]; // SHIFT-E followed by NUM is a countermand
+            show_edges ();
         }
-        return numbr_codes [Fset];
-    }
-    else if (bits == CAPS_BIT) // Only the Caps key is pressed, no other keys
-    {
-        LCL_SHFT = 1; // Record that a shift was pressed
-        if (CAPS >= 2) // already locked, so next push clears it
+#endif // SER_DBG_ON
+
+        // Rept on its own is the end of a held chord - stop repeating
+        if ((chord.bits & ~KB_HOLD_KEYS) == 0)
         {
-            CAPS = 0;
+            send_ctl (MSG_RPT_OFF);
+            continue;
         }
-        else // Set the CAPS key; if already set, then "lock" it
+
+        // Switch keymap bank, if asked - the chord types nothing itself
+        if ((chord.bits & ~(FINGERS_MASK | KB_HOLD_KEYS)) == BANK_BITS)
         {
-            ++CAPS;
+            bank_select (chord.bits & FINGERS_MASK);
+            continue;
         }
-    }
-    else if (Mods == CAPS_BIT) // Only the Caps modifier is set but SOME finger keys pressed  - command codes
-    {
-        // Generate command code
-        return cmd_codes [Fset];
-    }
-    else if (bits == (THUMB_BIT | NUM_BIT)) // Thumb and NUM pressed together, no other keys
-    {
-        if (NUM_LK >= 2) // already locked, so next push clears it
+
+        // Pick up a change of bank (from the chord, or the host) or of host layout
+        // between chords, so a chord is never decoded with part of one keymap and
+        // part of another
+        if (cur_map != bank_keymap ())
         {
-            NUM_LK = 0;
+            cur_map = bank_keymap ();
+            dec_state = DEC_STATE (0, 0, 0); // start the new keymap unshifted
+            mods_latched = 0;
+            mods_locked = 0;
+#ifdef SER_DBG_ON
+            printf ("\nKeymap bank %lu: %.*s\n", (unsigned long)bank_current (), KB_BANK_NAME, cur_map->hdr.name);
+#endif // SER_DBG_ON
         }
-        else // Set the NUM_LK key; if already set, then "lock" it
+        cur_host = host_table ();
+
+        // send a char code
+        char cc = decode_chord (&chord);
+        if (cc)
         {
-            ++NUM_LK;
+#ifdef SER_DBG_ON
+            printf ("%c", make_printable (cc));
+#endif // SER_DBG_ON
+            // If Rept is still held, the key repeats until it is released
+            if ((make_usb_key (cc)) && (chord.held))
+            {
+                send_ctl (MSG_RPT_ON);
+            }
         }
     }
-    else if (bits == (THUMB_BIT | CAPS_BIT)) // Thumb and CAPS pressed together, no other keys - clear shift
-    {
-        CAPS = 0;
-        NUM_LK = 0;
-        SHFTE  = 0;
-    }
-    else if (bits == (NUM_BIT | CAPS_BIT)) // NUM and CAPS pressed together, no other keys - eShift
-    {
-        SHFTE  = 1;
-    }
-    else if (Mods == (NUM_BIT | CAPS_BIT)) // NUM and CAPS pressed together, SOME finger keys pressed  - countermands
-    {
-        // Generate countermands keycode
-        return cntrc_codes [Fset];
-    }
-    return 0;
-} // decode_bits
+} // keyboard_task
 
-/* The "main" task on the second core.
- * This manages the reading and initial decoding of the keyboard matrix. */
-void keyboard_task (void)
-{
-    // signal to the primary thread that this worker thread is ready
-    multicore_fifo_push_blocking (99);
+#ifdef SER_DBG_ON
+// The last key queued, for main() to echo - printf is not safe from the interrupt
+static const kb_report *echo_key = NULL;
+#endif // SER_DBG_ON
 
-    uint sum_bits = 0;
+/* Take messages from core-1, and queue their keys for hid_task(). This runs
+ * on core-0, from the FIFO interrupt as each message arrives, and from main()
+ * (with that interrupt masked) to catch any left behind. A frame is only
+ * taken when there is room for all of its reports, so a burst waits in the
+ * message queue (holding core-1 back if need be) rather than being dropped. */
+static void msg_task (void)
+{
+    key_msg msgs [MSG_SEQ_MAX];
+    uint32_t count, idx;
 
-    // Forever - scan for key presses, ORing them all together.
-    while (true)
+    while ((count = msg_get (msgs, kc_room ())) != 0)
     {
-        // What keys are currently pressed?
-        uint32_t all_bits = gpio_get_all();
-        all_bits = ~all_bits; // keys are active low, invert the read
-        all_bits = all_bits >> 2; // shift bits [9:2] down to become [7:0]
-        all_bits = all_bits & 0xFF; // Mask, just in case...
-
-        // OR all the bits together
-        if (all_bits)
+        if (msgs[0].flags & MSG_F_CTL)
         {
-            sum_bits |= all_bits;
+            if (msgs[0].cmd == MSG_RPT_ON)
+            {
+                rpt_start ();
+            }
+            else if (msgs[0].cmd == MSG_RPT_OFF)
+            {
+                rpt_stop ();
+            }
         }
-        // When ALL keys are released, decode the combo.
-        else if ((sum_bits != 0) && (all_bits == 0))
+        else
         {
-            // send a char code
-            char cc = decode_bits (sum_bits);
-            if (cc)
+            // queue the sequence - any new key stops a repeat, and the
+            // frame takes over from the last one as the one to repeat
+            rpt_stop ();
+            for (idx = 0; idx < rpt_count; ++idx)
             {
+                report_drop (rpt_keys [idx]);
+            }
+            for (idx = 0; idx < count; ++idx)
+            {
+                kc_put (msgs[idx].report, (msgs[idx].flags & MSG_F_END) != 0);
+                rpt_keys [idx] = msgs[idx].report;
+                report_hold (rpt_keys [idx]);
+            }
+            rpt_count = count;
 #ifdef SER_DBG_ON
-                printf ("%c", make_printable (cc));
+            echo_key = rpt_keys [0];
 #endif // SER_DBG_ON
-                make_usb_key (cc);
-            }
-            // clear out the code for next pass
-            sum_bits = 0;
         }
-
-        sleep_ms (20);
     }
-} // keyboard_task
+} // msg_task
+
+// SIO FIFO interrupt on core-0 - core-1 has rung the doorbell
+static void fifo_isr (void)
+{
+    multicore_fifo_drain (); // the doorbells, even if there is no room for the messages yet
+    multicore_fifo_clear_irq (); // and any FIFO error flags
+    msg_task ();
+} // fifo_isr
 
 // main - initialize the board, start tinyusb, start the worker thread
 int main()
@@ -568,14 +630,11 @@ int main()
     gpio_init(LED_PIN);
     gpio_set_dir(LED_PIN, GPIO_OUT);
 
-    // Init the keyboard GPIO lines [9:2] for input with pull-ups
-    int idx;
-    for (idx = 2; idx <= 9; ++idx)
-    {
-        gpio_init (idx);
-        gpio_set_dir(idx, GPIO_IN);
-        gpio_pull_up (idx);
-    }
+    // Init the keyboard GPIO lines for input with pull-ups, from the pin map
+    scan_pins_init ();
+
+    // All the HID report slots start out free, for core-1 to fill
+    report_pool_init ();
 
     tusb_init(); // start tinyusb
 
@@ -584,6 +643,7 @@ int main()
     printf ("\n-- PicoWriter starting --\n");
 
     printf ("Device ID: %s\n", id_string);
+    int idx;
     for (idx = 0; idx < 8; ++idx)
     {
         printf ("%02X ", id_out.id[idx]);
@@ -591,6 +651,13 @@ int main()
     printf ("\nID done\n");
 #endif // SER_DBG_ON
 
+    // Check the keymap banks in flash, before core-1 can use them
+#ifdef SER_DBG_ON
+    printf ("Keymap banks found: %lu\n", (unsigned long)bank_init ());
+#else
+    bank_init ();
+#endif // SER_DBG_ON
+
     // Start the keyboard scanner thread on core-1
     multicore_launch_core1 (keyboard_task);
     // Wait for it to start up
@@ -610,24 +677,65 @@ int main()
 #endif // SER_DBG_ON
     }
 
-    // forever - read keycodes from core-1 and pass them to the hid_task() for sending
-    while (true)
-    {
-        if (multicore_fifo_rvalid ()) // data pending in FIFO
-        {
-            uint32_t uv = multicore_fifo_pop_blocking();
-            // queue the key-down
-            kc_put (uv);
+    // Messages from core-1 are now taken as they arrive, by the FIFO interrupt
+    multicore_fifo_clear_irq ();
+    irq_set_exclusive_handler (SIO_IRQ_PROC0, fifo_isr);
+    irq_set_enabled (SIO_IRQ_PROC0, true);
 
 #ifdef SER_DBG_ON
-            // diagnostic - echo the keycode to the serial i/o
-            printf ("  %08X \b\b\b\b\b\b\b\b\b\b\b", (unsigned)uv);
+    uint32_t overflows = 0;
+    uint32_t drops = 0;
+    uint32_t chord_drops = 0;
+    uint32_t pool_misses = 0;
 #endif // SER_DBG_ON
-        }
 
+    // forever - service the USB, and send the keys queued by the FIFO interrupt
+    while (true)
+    {
+        // The FIFO interrupt works on the key queue and repeat too, and tud_task()
+        // can send from the key queue (see tud_hid_report_complete_cb), so hold
+        // it off meanwhile
+        irq_set_enabled (SIO_IRQ_PROC0, false);
         tud_task(); // tinyusb device task
         led_blinking_task(); // LED heartbeat (in usb-stack.c)
+        msg_task(); // pick up any messages left waiting for room in the queue
+        rpt_task(); // typematic repeat for the Rept key
         hid_task(); // HID processing task (in usb-stack.c)
+
+#ifdef SER_DBG_ON
+        if (echo_key)
+        {
+            // diagnostic - echo the keycodes to the serial i/o
+            printf ("  %02X%02X%02X%02X \b\b\b\b\b\b\b\b\b\b\b", echo_key->mods,
+                    echo_key->keys[0], echo_key->keys[1], echo_key->keys[2]);
+            echo_key = NULL;
+        }
+        if (msg_overflows () != overflows)
+        {
+            overflows = msg_overflows ();
+            printf ("\nMessage queue overflow, %lu lost\n", (unsigned long)overflows);
+        }
+        if (report_pool_misses () != pool_misses)
+        {
+            pool_misses = report_pool_misses ();
+            printf ("\nReport pool empty, %lu lost\n", (unsigned long)pool_misses);
+        }
+        if (kc_drops () != drops)
+        {
+            drops = kc_drops ();
+            printf ("\nKey queue full, %lu lost (most waiting %lu)\n", (unsigned long)drops,
+                    (unsigned long)kc_high_water ());
+        }
+        if (scan_chord_drops () != chord_drops)
+        {
+            chord_drops = scan_chord_drops ();
+            printf ("\nChord queue full, %lu lost\n", (unsigned long)chord_drops);
+        }
+#endif // SER_DBG_ON
+        irq_set_enabled (SIO_IRQ_PROC0, true);
+
+        // Sleep until an interrupt (USB, FIFO, repeat) or the next tick is due
+        best_effort_wfe_or_timeout (make_timeout_time_ms (IDLE_WAKE_MS));
     }
     return 0;
 } // main
@@ -9,26 +9,252 @@
  extern "C" {
 #endif
 
+/* How the HID reports go out. With PW_EVENT_HID set, each report is sent as
+ * soon as the host has taken the last one (from tud_hid_report_complete_cb),
+ * and the endpoint asks to be polled every 1ms, so the host's polling sets
+ * the rate. Otherwise hid_task() sends one every PW_POLL ms. */
+#ifndef PW_EVENT_HID
+#define PW_EVENT_HID 1
+#endif
+
+// Let a key go down while the keys before it are still down, so a burst of
+// keys takes one report each, not two (see can_roll() in usb-stack.c)
+#ifndef HID_ROLLOVER
+#define HID_ROLLOVER 1
+#endif
+
 // Define the polling rate for the USB HID service
+#if (PW_EVENT_HID)
+#define PW_POLL  1   // 1ms polling rate (bInterval)
+#else
 #define PW_POLL  10  // default to 10ms polling rate
+#endif
+
+// Two-handed build - 8 keys on each hand, see decode_chord() in kb-main.c
+#ifndef KB_TWO_HAND
+#define KB_TWO_HAND 0 // one hand, 8 keys, by default
+#endif
+
+#if (KB_TWO_HAND)
+// 16 keys, the right hand in [7:0] and the left hand in [15:8], each hand Pinky first.
+#define KB_NUM_KEYS  16
+#define KB_NUM_PINS  16
+
+// The GPIO pin for each key switch, in bit order, right hand then left hand.
+// By default GPIO pins [17:2], since GPIO 0,1 are used for the serial port.
+// Can be changed at start up with scan_set_pin_map()
+#ifndef KB_PIN_MAP
+#define KB_PIN_MAP 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17
+#endif
+#else
+// There are 8 keys, and a 9th switch so the layout is symmetrical for mirror mode.
+#define KB_NUM_KEYS  8
+#define KB_NUM_PINS  9
+
+// The GPIO pin for each key switch, in bit order, Pinky first and the 9th switch last.
+// By default GPIO pins [10:2], since GPIO 0,1 are used for the serial port.
+// Can be changed at start up with scan_set_pin_map()
+#ifndef KB_PIN_MAP
+#define KB_PIN_MAP 2, 3, 4, 5, 6, 7, 8, 9, 10
+#endif
+#endif // KB_TWO_HAND
+
+// Left-handed "mirror" mode - the switches are bit-reversed to make the keys.
+// Can also be set with scan_set_mirror(). Not used in the two-handed build.
+#ifndef MIRROR_MODE
+#define MIRROR_MODE 0 // right-handed by default
+#endif
+
+// Key switch scanning modes (see kb-scan.c)
+#define SCAN_POLL 0  // read the switches then sleep for SCAN_POLL_MS, forever
+#define SCAN_IRQ  1  // driven by GPIO edge interrupts, core-1 sleeps between edges
+#define SCAN_TIMER 2 // sampled at a fixed, adaptive, rate from a hardware alarm
+#define SCAN_PIO  3  // a PIO state machine accumulates the chord, core-1 wakes once per chord
 
-// Used to pass a key-combo from the keyboard thread to the USB thread.
-// Uses a pico FIFO to pass a unit32_t. This word has 4 "codes" packed into
-// it as "modifiers", "k1", "k2", "k3"
-// At most this supports a 3-key combo, which gamers might find derisory
-// but is plenty for emulating the Microwriter!
-typedef union
+#ifndef KB_SCAN_MODE
+#define KB_SCAN_MODE SCAN_IRQ
+#endif
+
+#ifndef SCAN_POLL_MS
+#define SCAN_POLL_MS 20  // sleep period for the SCAN_POLL mode
+#endif
+
+// Sample rates for the SCAN_TIMER mode, can also be changed with scan_set_rates().
+// SCAN_IRQ also samples at SCAN_ACTIVE_HZ from a key release, until it is debounced
+#ifndef SCAN_ACTIVE_HZ
+#define SCAN_ACTIVE_HZ 1000  // while keys are down, or were released recently
+#endif
+#ifndef SCAN_IDLE_HZ
+#define SCAN_IDLE_HZ   50    // when nothing has happened for SCAN_LINGER_MS
+#endif
+#ifndef SCAN_LINGER_MS
+#define SCAN_LINGER_MS 250   // how long to keep scanning fast after the last key is released
+#endif
+#ifndef SCAN_ALARM_NUM
+#define SCAN_ALARM_NUM 2     // hardware alarm used by the scanner (the SDK default pool uses 3)
+#endif
+
+// Key release debounce window, can also be changed with scan_set_debounce()
+#ifndef DEBOUNCE_MS
+#define DEBOUNCE_MS 5
+#endif
+
+// Keys that hold a chord open - if everything else is released while one of
+// these is still down, the chord is passed on at once, flagged as held.
+#if (KB_TWO_HAND)
+#define KB_HOLD_KEYS 0x8080 // the Rept key on either hand, RPT_BIT in kb-main.c
+#else
+#define KB_HOLD_KEYS 0x80 // the Rept key, RPT_BIT in kb-main.c
+#endif
+
+// Typematic repeat, while Rept is held after a chord. Can also be set with rpt_set_rate()
+#ifndef RPT_DELAY_MS
+#define RPT_DELAY_MS 500 // before the first repeat
+#endif
+#ifndef RPT_RATE_HZ
+#define RPT_RATE_HZ  20  // repeats per second, after that
+#endif
+
+// Rolling mode - end each chord when the first of its keys is released, rather
+// than waiting for them all to be released. Can also be set with scan_set_rolling()
+#ifndef ROLL_MODE
+#define ROLL_MODE 0       // off by default
+#endif
+#ifndef ROLL_WINDOW_MS
+#define ROLL_WINDOW_MS 30 // keys of an ended chord held longer than this join the next one
+#endif
+
+// Keymap banks in flash, as well as the built-in keymap (see kb-bank.c)
+#ifndef KB_BANK_COUNT
+#define KB_BANK_COUNT 4
+#endif
+
+// The keyboard layout the host is set to, at start up - HOST_US, HOST_UK,
+// HOST_DE or HOST_FR (see kb-layout.h). The host can change it later. A US
+// host has no keys for the £ and € chords, so they send nothing there.
+#ifndef KB_HOST_LAYOUT
+#define KB_HOST_LAYOUT HOST_US
+#endif
+
+// A completed chord, as passed from the scanner to the decoder
+typedef struct
+{
+    uint32_t bits;     // every key pressed during the chord, ORed together
+    uint32_t peak;     // the most keys that were held down at once
+    uint32_t start_us; // time the first key went down
+    uint32_t hold_us;  // from the first press to the last release (0 if not known)
+    uint8_t  first;    // which key went down first
+    uint8_t  held;     // 1 if passed on while a hold key (Rept) was still down
+} chord_rec;
+
+// A single key press or release, as logged by the scanner
+typedef struct
+{
+    uint32_t time_us; // when it happened
+    uint8_t  key;     // bit number of the key
+    uint8_t  down;    // 1 for a press, 0 for a release
+} key_edge;
+
+// A USB HID keyboard report, as core-1 sends it. Core-1 builds these in
+// place, in slots from a pool in kb-queue.c, so only a pointer crosses to
+// core-0. It holds up to six keys at once, the boot keyboard's limit - plenty
+// for emulating the Microwriter. The USB thread does not send these as they
+// are: usb-stack.c takes the keys from each into the set it holds down on the
+// host (which can be more than six on the NKRO interface, and rolls over from
+// one key to the next), and builds the report for the interface in use from that.
+typedef struct
+{
+    uint8_t mods;     // modifier bits, KEYBOARD_MODIFIER_xxx
+    uint8_t reserved;
+    uint8_t keys [6]; // HID key codes, in order of pressing
+} kb_report;
+
+/* A message from core-1 to core-0, passed through the queue in kb-queue.c.
+ * Messages travel in frames of one or more records, queued and taken as a
+ * unit. A frame of key records is a sequence of report states, sent to the
+ * host one after another, then all the keys are released. The first record
+ * gives the length of the frame, and the last is flagged as the end. */
+typedef struct
 {
-    uint32_t u_msg;
-    uint8_t  p [4];
-} msg_blk;
+    uint32_t   time_us; // when core-1 queued it
+    kb_report *report;  // the report state, NULL for a control message
+    uint8_t    flags;   // MSG_F_xxx
+    uint8_t    cmd;     // the command, for a control message
+    uint8_t    count;   // records in the frame, in its first record
+} key_msg;
+
+#define MSG_F_CTL     0x01 // a control message, not a key-combo
+#define MSG_F_END     0x02 // the last record in a frame
+#define MSG_RPT_ON    1    // start repeating the last key
+#define MSG_RPT_OFF   2    // stop repeating
+
+// Depth of the core-1 to core-0 message queue, must be a power of 2
+#ifndef MSG_Q_SZ
+#define MSG_Q_SZ 64
+#endif
+// How long core-1 waits for room in a full queue, before dropping the message
+#ifndef MSG_WAIT_MS
+#define MSG_WAIT_MS 500
+#endif
+#ifndef MSG_SEQ_MAX
+#define MSG_SEQ_MAX 8      // the most records in a frame
+#endif
+#define MSG_DOORBELL 0x55 // pushed into the SIO FIFO when a message is queued
+
+// Number of HID report slots, must be a power of 2. Core-1 waits (as for a full
+// queue) if they are all in use.
+#ifndef HID_POOL_SZ
+#define HID_POOL_SZ 64
+#endif
+
+// Depth of the queue of HID reports waiting to be sent, must be a power of 2.
+// A frame from core-1 is only taken when there is room for all of it.
+#ifndef KC_SZ
+#define KC_SZ 64
+#endif
+
+// Depth of the queue of completed chords waiting for core-1 to decode them, must
+// be a power of 2. It fills while core-1 is held up waiting for room in the
+// message queue or report pool (up to MSG_WAIT_MS a time), as the scanning
+// interrupts go on finding chords meanwhile. In SCAN_POLL mode nothing is
+// scanned during that wait, so keys pressed then are missed, not queued.
+#ifndef CQ_SZ
+#define CQ_SZ 32
+#endif
 
 // defined in kb-main.c
-extern uint32_t kc_get (void);
+extern kb_report *kc_get (bool *last);
+extern bool kc_waiting (void);
+extern uint32_t kc_high_water (void);
+extern uint32_t kc_drops (void);
+extern void rpt_set_rate (uint32_t delay_ms, uint32_t rate_hz);
+
+// Defined in kb-scan.c
+extern bool scan_set_pin_map (const uint8_t *pins);
+extern void scan_pins_init (void);
+extern void scan_init (void);
+extern void scan_get_chord (chord_rec *rec);
+extern uint32_t scan_chord_drops (void);
+extern bool scan_get_edge (key_edge *edge);
+extern void scan_set_rates (uint32_t active_hz, uint32_t idle_hz); // SCAN_IRQ and SCAN_TIMER only
+extern void scan_set_debounce (uint32_t window_ms);
+extern void scan_set_rolling (bool on, uint32_t window_ms); // not in SCAN_PIO
+extern void scan_set_mirror (bool left); // one-handed build only
+
+// Defined in kb-queue.c
+extern bool msg_put (const key_msg *msgs, uint32_t count); // core-1 only
+extern uint32_t msg_get (key_msg *msgs, uint32_t room);   // core-0 only
+extern uint32_t msg_overflows (void);
+extern void report_pool_init (void);
+extern kb_report *report_alloc (void);     // core-1 only
+extern uint32_t report_pool_misses (void);
+extern void report_hold (kb_report *rpt);  // core-0 only
+extern void report_drop (kb_report *rpt);  // core-0 only
 
 // Defined in usb-stack.c
 extern void led_blinking_task(void);
 extern void hid_task(void);
+extern bool hid_key_idle(void);
 
 // Defined in usb_descriptors.c
 extern void set_serial_string (char const *ser);
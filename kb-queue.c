@@ -0,0 +1,223 @@
+/*
+ * Message queue from core-1 to core-0, for the Microwriter / CyKey keyboard emulation.
+ *
+ * The hardware FIFO between the cores is only 8 words deep, and a word is
+ * too small for much more than a key combo. So the messages go through a
+ * ring in shared SRAM instead, written only by core-1 and read only by
+ * core-0, so no lock is needed: each side owns one index, and a barrier
+ * makes sure a slot is complete before the other side can see it.
+ *
+ * The FIFO is then just a doorbell, a word pushed to tell core-0 there is
+ * something in the ring. If the FIFO is already full, core-0 has plenty of
+ * doorbells pending anyway, so the push is skipped.
+ *
+ * Messages go in frames of one or more records (see key_msg), which are
+ * queued and taken whole. If the ring fills up, core-1 waits for core-0 to
+ * make room, for up to MSG_WAIT_MS, before giving up on that frame and
+ * counting an overflow.
+ *
+ * Key presses travel as HID reports, built by core-1 straight into slots
+ * from a fixed pool, so only a pointer goes through the ring. Core-0 takes
+ * the keys from the slot as it sends them, then gives it back. If no slot
+ * comes free within MSG_WAIT_MS, the key is lost and counted as a pool miss.
+ * Free slots go back to core-1 through a second ring, the other way round,
+ * so that is lock-free too. Core-0 may hold a slot in more than one place
+ * (queued to send, and kept for repeating), so it counts the references
+ * before freeing one.
+ */
+
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+
+// local parts
+#include "kb-main.h"
+
+#define MQ_MSK (MSG_Q_SZ - 1)
+
+#if (MSG_Q_SZ & MQ_MSK)
+#error "MSG_Q_SZ must be a power of 2"
+#endif
+#if (MSG_SEQ_MAX > MSG_Q_SZ) || (MSG_SEQ_MAX > 255)
+#error "MSG_SEQ_MAX frames will not fit in the queue"
+#endif
+
+// The ring. The indices run freely and are masked on use, so in - out is
+// always the number of messages waiting, even when the ring is full.
+static key_msg msg_q [MSG_Q_SZ];
+static volatile uint32_t mq_in  = 0; // written by core-1 only
+static volatile uint32_t mq_out = 0; // written by core-0 only
+static volatile uint32_t mq_overflows = 0;
+
+/* Queue a frame of messages for core-0 - called on core-1 only. The frame
+ * is stamped with its length and end marker here, and only made visible to
+ * core-0 once all of it is in the ring, so core-0 never sees part of one.
+ * Returns false if there was no room for it, even after waiting. */
+bool msg_put (const key_msg *msgs, uint32_t count)
+{
+    uint32_t in = mq_in;
+    uint32_t idx;
+
+    if ((count == 0) || (count > MSG_SEQ_MAX))
+    {
+        return false; // not a frame we can pass on
+    }
+
+    if ((in - mq_out) > (MSG_Q_SZ - count))
+    {
+        // queue full - hold core-1 back until core-0 catches up
+        uint32_t start_us = time_us_32 ();
+        while ((in - mq_out) > (MSG_Q_SZ - count))
+        {
+            if ((time_us_32 () - start_us) >= (MSG_WAIT_MS * 1000))
+            {
+                // core-0 is stuck (USB suspended?), skip this frame
+                ++mq_overflows;
+                return false;
+            }
+            tight_loop_contents ();
+        }
+    }
+
+    for (idx = 0; idx < count; ++idx)
+    {
+        key_msg *slot = &msg_q [(in + idx) & MQ_MSK];
+        *slot = msgs [idx];
+        slot->count = (idx == 0) ? (uint8_t)count : 0;
+        if (idx == (count - 1))
+        {
+            slot->flags |= MSG_F_END;
+        }
+    }
+    __dmb (); // the frame must be written before core-0 can see the new index
+    mq_in = in + count;
+
+    // ring the doorbell
+    if (multicore_fifo_wready ())
+    {
+        multicore_fifo_push_blocking (MSG_DOORBELL);
+    }
+    return true;
+} // msg_put
+
+/* Take the next frame from core-1 - called on core-0 only.
+ * The frame is only taken if it fits in "room" records (and in msgs, which
+ * must hold MSG_SEQ_MAX). Returns the number of records taken, 0 if there
+ * is nothing waiting, or not enough room for it. */
+uint32_t msg_get (key_msg *msgs, uint32_t room)
+{
+    uint32_t out = mq_out;
+    uint32_t count, idx;
+
+    // the ring is checked anyway, so the doorbells are just thrown away
+    multicore_fifo_drain ();
+
+    if (out == mq_in)
+    {
+        return 0;
+    }
+    __dmb (); // read the frame only after seeing the index that covers it
+    count = msg_q [out & MQ_MSK].count;
+    if ((count > room) || (count > MSG_SEQ_MAX))
+    {
+        return 0; // leave it for later
+    }
+    for (idx = 0; idx < count; ++idx)
+    {
+        msgs [idx] = msg_q [(out + idx) & MQ_MSK];
+    }
+    __dmb (); // finish with the frame before core-1 can reuse its slots
+    mq_out = out + count;
+    return count;
+} // msg_get
+
+// How many messages have been lost because the queue was full
+uint32_t msg_overflows (void)
+{
+    return mq_overflows;
+} // msg_overflows
+
+// The report slots, and the ring of free ones going back to core-1.
+// The free ring is as deep as the pool, so it can never overflow.
+#define HP_MSK (HID_POOL_SZ - 1)
+
+#if (HID_POOL_SZ & HP_MSK) || (HID_POOL_SZ > 256)
+#error "HID_POOL_SZ must be a power of 2, no more than 256"
+#endif
+
+static kb_report hid_pool [HID_POOL_SZ];
+static uint8_t hp_refs [HID_POOL_SZ];    // core-0 only
+static uint8_t hp_free [HID_POOL_SZ];
+static volatile uint32_t hp_in  = 0;     // written by core-0 only
+static volatile uint32_t hp_out = 0;     // written by core-1 only
+static volatile uint32_t hp_misses = 0;
+
+// Put all the slots on the free ring - call before core-1 is started
+void report_pool_init (void)
+{
+    uint32_t idx;
+    for (idx = 0; idx < HID_POOL_SZ; ++idx)
+    {
+        hp_free [idx] = (uint8_t)idx;
+        hp_refs [idx] = 0;
+    }
+    hp_out = 0;
+    hp_in = HID_POOL_SZ;
+} // report_pool_init
+
+// Get a free report slot - called on core-1 only.
+// Waits for one, as msg_put() does, and returns NULL if none comes free.
+kb_report *report_alloc (void)
+{
+    uint32_t out = hp_out;
+
+    if (out == hp_in)
+    {
+        // all in use - hold core-1 back until core-0 sends some
+        uint32_t start_us = time_us_32 ();
+        while (out == hp_in)
+        {
+            if ((time_us_32 () - start_us) >= (MSG_WAIT_MS * 1000))
+            {
+                ++hp_misses;
+                return NULL;
+            }
+            tight_loop_contents ();
+        }
+    }
+
+    __dmb (); // read the slot number only after seeing the index that covers it
+    kb_report *rpt = &hid_pool [hp_free [out & HP_MSK]];
+    __dmb ();
+    hp_out = out + 1;
+    return rpt;
+} // report_alloc
+
+// How many times no report slot came free in time
+uint32_t report_pool_misses (void)
+{
+    return hp_misses;
+} // report_pool_misses
+
+// Take another reference to a report slot - called on core-0 only
+void report_hold (kb_report *rpt)
+{
+    ++hp_refs [rpt - hid_pool];
+} // report_hold
+
+// Let go of a report slot, it goes back to core-1 with the last reference.
+// Called on core-0 only.
+void report_drop (kb_report *rpt)
+{
+    uint32_t slot = (uint32_t)(rpt - hid_pool);
+
+    if ((hp_refs [slot] == 0) || (--hp_refs [slot] != 0))
+    {
+        return; // not held, or still in use
+    }
+    hp_free [hp_in & HP_MSK] = (uint8_t)slot;
+    __dmb (); // the slot number must be written before core-1 can see the new index
+    hp_in = hp_in + 1;
+} // report_drop
+
+/* End of File */
@@ -0,0 +1,850 @@
+/*
+ * Key switch scanning for the Microwriter / CyKey keyboard emulation.
+ *
+ * This runs on the second core (core-1). It watches the key switches,
+ * ORs together every switch that is pressed during a chord, and hands the
+ * combined mask back to keyboard_task() once ALL the switches have been
+ * released again.
+ *
+ * Four scanning modes are available, selected by KB_SCAN_MODE in kb-main.h:
+ *
+ * SCAN_POLL - the original scheme, read the switches then sleep for
+ *             SCAN_POLL_MS, forever. Simple, but adds up to SCAN_POLL_MS of
+ *             latency to every chord and can miss very short taps.
+ *
+ * SCAN_IRQ  - GPIO edge interrupts on the switch pins. Core-1 sleeps until
+ *             an edge arrives, the edge handler ORs the switches into the
+ *             chord, then samples at SCAN_ACTIVE_HZ while keys are down so
+ *             the chord is passed on as soon as the last release settles.
+ *
+ * SCAN_TIMER - sampled from a hardware alarm on core-1, at an exact fixed
+ *             period. Scans fast (SCAN_ACTIVE_HZ) while any switch is down
+ *             or was released within the last SCAN_LINGER_MS, and drops back
+ *             to a slow rate (SCAN_IDLE_HZ) when idle, to save power.
+ *
+ * SCAN_PIO  - a PIO state machine samples the switches and detects the end
+ *             of the chord itself (see kb-chord.pio), with DMA moving its
+ *             samples into RAM. Core-1 is only interrupted once per chord.
+ *
+ * In the CPU sampled modes, each sample of the switches goes through a debounce stage
+ * before it is ORed into the chord (see debounce(), below). Completed chords
+ * are queued and picked up by scan_get_chord(), so that in the interrupt
+ * driven modes a new chord can start while keyboard_task() is still busy
+ * with the previous one.
+ *
+ * Keys in KB_HOLD_KEYS (the Rept key) can hold a chord open: if all the
+ * other keys are released while a hold key is still down, the chord is passed
+ * on at once, flagged as "held", and the release of the hold key then follows
+ * as a chord of its own. This is not available in SCAN_PIO mode.
+ *
+ * There is also an optional "rolling" mode (not in SCAN_PIO), where a chord
+ * is passed on as soon as its keys start to be released, see roll_sample().
+ *
+ * As well as the OR of the keys, each chord record carries the keys held
+ * at the peak, which key went down first and how long the chord was held,
+ * and every press and release is logged with its time, for tracing.
+ */
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/gpio.h"
+#include "hardware/sync.h"
+#include "pico/time.h"
+
+// local parts
+#include "kb-main.h"
+
+#if (KB_SCAN_MODE == SCAN_PIO) && (KB_TWO_HAND)
+#error "kb-chord.pio samples 9 switches, the two-handed build needs another scanning mode"
+#endif
+
+#if (KB_SCAN_MODE == SCAN_PIO)
+#include "hardware/pio.h"
+#include "hardware/dma.h"
+#include "hardware/clocks.h"
+#include "kb-chord.pio.h"
+#endif // SCAN_PIO
+
+// Mask of the switches, once gathered down to the bottom bits
+#define PINS_MASK ((1u << KB_NUM_PINS) - 1)
+
+/* The GPIO pin for each switch, in switch order. Any pins will do.
+ * A read of all the GPIO is gathered into the switch mask one byte at a
+ * time: pin_gather[n][b] is the set of switches on the pins in byte n of the
+ * GPIO word when that byte reads b. So the gather is four lookups and three
+ * ORs, however the pins are laid out. */
+static uint8_t kb_pins [KB_NUM_PINS] = { KB_PIN_MAP };
+static uint16_t pin_gather [4][256];
+
+static void pin_gather_init (void)
+{
+    uint32_t val;
+    int idx;
+
+    memset (pin_gather, 0, sizeof (pin_gather));
+    for (idx = 0; idx < KB_NUM_PINS; ++idx)
+    {
+        uint32_t pin = kb_pins [idx];
+        for (val = 0; val < 256; ++val)
+        {
+            if (val & (1u << (pin & 7)))
+            {
+                pin_gather [pin >> 3][val] |= (uint16_t)(1u << idx);
+            }
+        }
+    }
+} // pin_gather_init
+
+// Gather the switch bits out of a (non-inverted) GPIO word
+static inline uint32_t gather_pins (uint32_t gpio)
+{
+    return pin_gather [0][gpio & 0xFF] | pin_gather [1][(gpio >> 8) & 0xFF] |
+           pin_gather [2][(gpio >> 16) & 0xFF] | pin_gather [3][gpio >> 24];
+} // gather_pins
+
+/* Change the switch pins. Call this before scan_pins_init(), e.g. to pick the
+ * map for the board in use at start up. Returns false if the map is no good. */
+bool scan_set_pin_map (const uint8_t *pins)
+{
+    int idx;
+    uint32_t used = 0;
+
+    for (idx = 0; idx < KB_NUM_PINS; ++idx)
+    {
+        if ((pins [idx] >= NUM_BANK0_GPIOS) || (used & (1u << pins [idx])))
+        {
+            return false; // no such pin, or used twice
+        }
+        used |= 1u << pins [idx];
+    }
+    memcpy (kb_pins, pins, sizeof (kb_pins));
+    return true;
+} // scan_set_pin_map
+
+// Init the keyboard GPIO lines for input with pull-ups, from the pin map.
+// Called by main() on core-0, before the scanner is started on core-1
+void scan_pins_init (void)
+{
+    int idx;
+    for (idx = 0; idx < KB_NUM_PINS; ++idx)
+    {
+        gpio_init (kb_pins [idx]);
+        gpio_set_dir (kb_pins [idx], GPIO_IN);
+        gpio_pull_up (kb_pins [idx]);
+    }
+    pin_gather_init ();
+} // scan_pins_init
+
+#if (KB_TWO_HAND)
+/* Two-handed, every switch is a key, so there is nothing to map: the pin map
+ * puts the right hand in [7:0] and the left hand in [15:8]. */
+static inline uint32_t map_keys (uint32_t pins)
+{
+    return pins;
+} // map_keys
+#else
+/* Map the switches onto the key bits, for each hand.
+ * Right-handed, the 9th switch is not used and switch n is just key bit n.
+ * Left-handed ("mirror" mode, as on the CyKey) the switches are bit-reversed
+ * across all 9 and the 9th (at the other end) becomes the Pinky, so the same
+ * layout tables work for both hands. Built once at start up, so mapping a
+ * read is one table lookup, whichever hand is in use. */
+static uint8_t key_map [2][1 << KB_NUM_PINS];
+static const uint8_t * volatile key_remap = key_map [0];
+
+static void key_map_init (void)
+{
+    uint32_t pins;
+    int idx;
+
+    for (pins = 0; pins <= PINS_MASK; ++pins)
+    {
+        uint32_t mirror = 0;
+        for (idx = 0; idx < KB_NUM_PINS; ++idx)
+        {
+            if (pins & (1u << idx))
+            {
+                mirror |= 1u << (KB_NUM_PINS - 1 - idx);
+            }
+        }
+        key_map [0][pins] = (uint8_t)pins;   // right hand - drop the 9th switch
+        key_map [1][pins] = (uint8_t)mirror; // left hand - reversed, drop the 9th (now top) bit
+    }
+    key_remap = key_map [MIRROR_MODE ? 1 : 0];
+} // key_map_init
+
+// Select left-handed (mirror) or right-handed mode at runtime
+void scan_set_mirror (bool left)
+{
+    key_remap = key_map [left ? 1 : 0];
+} // scan_set_mirror
+
+// Map a read of the switches onto the keys
+static inline uint32_t map_keys (uint32_t pins)
+{
+    return key_remap [pins];
+} // map_keys
+#endif // KB_TWO_HAND
+
+// What keys are currently pressed?
+static inline uint32_t read_keys (void)
+{
+    uint32_t all_bits = gpio_get_all();
+    all_bits = ~all_bits; // keys are active low, invert the read
+    all_bits = gather_pins (all_bits); // gather the switch pins down to the bottom bits
+    return map_keys (all_bits); // map the switches to keys, for the hand in use
+} // read_keys
+
+// circular buffer for completed chords, pending decoding...
+#define CQ_MSK (CQ_SZ - 1)
+#if (CQ_SZ & CQ_MSK)
+#error "CQ_SZ must be a power of 2"
+#endif
+static chord_rec chord_q [CQ_SZ];
+static volatile uint32_t cq_in  = 0; // free-running, masked on use
+static volatile uint32_t cq_out = 0;
+static volatile uint32_t cq_drops = 0;
+
+// Used by scan_sample() to queue up completed chords
+static void chord_put (const chord_rec *rec)
+{
+    if ((cq_in - cq_out) >= CQ_SZ)
+    {
+        // queue full, lose this chord, but count it
+        ++cq_drops;
+        return;
+    }
+    chord_q [cq_in & CQ_MSK] = *rec;
+    cq_in = cq_in + 1;
+} // chord_put
+
+// The chord being built up, from the first key press to the last release
+static chord_rec chord_cur;
+
+// Fold another set of held keys into the chord being built
+static void chord_add (uint32_t held)
+{
+    // OR all the bits together
+    chord_cur.bits |= held;
+
+    // and track the most keys held down at once
+    if (__builtin_popcount (held) > __builtin_popcount (chord_cur.peak))
+    {
+        chord_cur.peak = held;
+    }
+} // chord_add
+
+// When ALL keys are released, the chord is complete - queue it for decoding
+static void chord_end (void)
+{
+    if (chord_cur.bits)
+    {
+        chord_put (&chord_cur);
+    }
+    memset (&chord_cur, 0, sizeof (chord_cur));
+} // chord_end
+
+// circular buffer for the key edges, for tracing and instrumentation.
+// This is a history - when full, the oldest edges are overwritten.
+#define EQ_SZ 64
+#define EQ_MSK (EQ_SZ - 1)
+static key_edge edge_q [EQ_SZ];
+static volatile uint32_t eq_in  = 0;
+static volatile uint32_t eq_out = 0;
+
+#if (KB_SCAN_MODE != SCAN_PIO)
+static void edge_put (uint32_t time_us, uint32_t key, uint32_t down)
+{
+    uint32_t next = (eq_in + 1) & EQ_MSK;
+    if (next == eq_out)
+    {
+        eq_out = (eq_out + 1) & EQ_MSK; // full, drop the oldest
+    }
+    edge_q [eq_in].time_us = time_us;
+    edge_q [eq_in].key = (uint8_t)key;
+    edge_q [eq_in].down = (uint8_t)down;
+    eq_in = next;
+} // edge_put
+#endif // !SCAN_PIO
+
+/* Debounce.
+ * A press is taken at once, on the first sample that sees the key down, so
+ * debounce adds no latency to the start of a chord. A release is only
+ * accepted once the key has read "up" for db_samples consecutive samples,
+ * which rides out the contact chatter - so the all-released edge that ends
+ * the chord cannot fire early, and the chatter cannot start a phantom chord.
+ * Only samples taken at the active scan rate count towards a release; an
+ * untimed sample (from an edge interrupt) can take a press, but not a release.
+ *
+ * The per-switch release counts are held as vertical counters: bit n of
+ * db_cnt[i] is bit i of the count for switch n, so all the switches are
+ * counted in parallel in a handful of word operations. */
+#define DB_PLANES 5
+#define DB_MAX ((1u << DB_PLANES) - 1) // longest window, in samples
+
+#if (KB_SCAN_MODE != SCAN_PIO)
+static uint32_t db_cnt [DB_PLANES];
+static uint32_t db_state = 0;   // the debounced key state
+#endif // !SCAN_PIO
+
+static uint32_t db_samples = 1; // samples needed to accept a release
+static uint32_t db_window_us = DEBOUNCE_MS * 1000;
+
+// Sample period while keys are down, in us
+#if (KB_SCAN_MODE == SCAN_POLL)
+static uint32_t scan_active_us = SCAN_POLL_MS * 1000;
+#else
+static uint32_t scan_active_us = 1000000 / SCAN_ACTIVE_HZ;
+#endif
+#if (KB_SCAN_MODE == SCAN_TIMER)
+static uint32_t scan_idle_us = 1000000 / SCAN_IDLE_HZ; // and while they are not
+#endif // SCAN_TIMER
+
+// Work out how many samples at the active scan rate cover the debounce window
+static void db_set_samples (void)
+{
+    uint32_t period = scan_active_us;
+    uint32_t count = (db_window_us + period - 1) / period;
+    if (count < 1) count = 1;
+    if (count > DB_MAX) count = DB_MAX;
+    db_samples = count;
+} // db_set_samples
+
+#if (KB_SCAN_MODE != SCAN_PIO)
+// Pass one raw sample through the debounce, returns the debounced keys
+static uint32_t debounce (uint32_t raw, bool timed)
+{
+    int idx;
+
+    if (!timed)
+    {
+        // Take any press, and restart the count of any key read as down,
+        // but leave the releases to be counted by the timed samples
+        for (idx = 0; idx < DB_PLANES; ++idx)
+        {
+            db_cnt [idx] &= ~raw;
+        }
+        db_state |= raw;
+        return db_state;
+    }
+
+    uint32_t carry = db_state & ~raw; // keys held by the debounce but read as released
+    uint32_t hit = carry; // those that have now been released for long enough
+
+    for (idx = 0; idx < DB_PLANES; ++idx)
+    {
+        uint32_t cnt = db_cnt [idx];
+        cnt = (cnt ^ carry) & ~raw; // count up; any key read as down restarts its count
+        carry = carry & db_cnt [idx];
+        hit &= (db_samples & (1u << idx)) ? cnt : ~cnt;
+        db_cnt [idx] = cnt;
+    }
+
+    db_state = (db_state | raw) & ~hit;
+
+    // Keys that are fully released need no count
+    for (idx = 0; idx < DB_PLANES; ++idx)
+    {
+        db_cnt [idx] &= db_state;
+    }
+    return db_state;
+} // debounce
+
+static uint32_t db_prev = 0; // the debounced keys at the last sample
+
+// Log the edges in the debounced keys, and time the chord from them.
+static void note_edges (uint32_t down, uint32_t up, uint32_t now)
+{
+    // A release is only accepted once it has lasted for the whole debounce
+    // window, so the key actually went up that many samples ago.
+    uint32_t up_us = now - ((db_samples - 1) * scan_active_us);
+
+    if ((chord_cur.bits == 0) && (down))
+    {
+        chord_cur.start_us = now;
+        chord_cur.first = (uint8_t)__builtin_ctz (down);
+    }
+
+    while (down)
+    {
+        uint32_t key = __builtin_ctz (down);
+        edge_put (now, key, 1);
+        down &= down - 1;
+    }
+    while (up)
+    {
+        uint32_t key = __builtin_ctz (up);
+        edge_put (up_us, key, 0);
+        if (chord_cur.bits & (1u << key)) // not a leftover from a rolled chord
+        {
+            chord_cur.hold_us = up_us - chord_cur.start_us;
+        }
+        up &= up - 1;
+    }
+} // note_edges
+
+/* Rolling mode.
+ * Normally a chord ends when ALL the keys are released. In rolling mode, it
+ * ends as soon as the first of its keys is released, and anything pressed
+ * after that starts the next chord - so fast typists can start the next
+ * chord while still lifting off the last. Keys still held from the committed
+ * chord are ignored, until released, for up to roll_window_us; one held any
+ * longer than that is taken as meant for the next chord, and joins it. */
+static bool roll_mode = (ROLL_MODE != 0);
+static uint32_t roll_window_us = ROLL_WINDOW_MS * 1000;
+
+static uint32_t roll_stale = 0;      // keys still held from a chord already committed
+static uint32_t roll_commit_us = 0;  // when that chord was committed
+
+static void roll_sample (uint32_t all_bits, uint32_t now)
+{
+    roll_stale &= all_bits; // leftover keys drop out as they are released
+
+    uint32_t fresh = all_bits & ~roll_stale;
+    if ((roll_stale) && ((fresh) || (chord_cur.bits)) && ((now - roll_commit_us) >= roll_window_us))
+    {
+        fresh = all_bits; // held too long to be a leftover, so part of this chord
+        roll_stale = 0;
+    }
+    if (fresh)
+    {
+        chord_add (fresh);
+    }
+
+    // The first key of the chord to be released commits it
+    if (chord_cur.bits & ~all_bits)
+    {
+        roll_stale = all_bits; // anything still down belongs to this chord
+        roll_commit_us = now;
+        chord_end ();
+    }
+} // roll_sample
+
+/* Runtime settings. The scan_set_xxx() calls come from the host, so on
+ * core-0, and masking interrupts there cannot stop the scan interrupts on
+ * core-1 seeing half a change. So they only write the new settings here,
+ * with a sequence count that is odd while they are being written, and
+ * core-1 takes them up between samples, all together, see cfg_apply(). */
+typedef struct
+{
+    uint32_t active_us;
+    uint32_t idle_us;
+    uint32_t db_window_us;
+    uint32_t roll_window_us;
+    bool     roll_on;
+} scan_cfg;
+
+static scan_cfg cfg_new = {
+#if (KB_SCAN_MODE == SCAN_POLL)
+    SCAN_POLL_MS * 1000, 0,
+#else
+    1000000 / SCAN_ACTIVE_HZ, 1000000 / SCAN_IDLE_HZ,
+#endif
+    DEBOUNCE_MS * 1000, ROLL_WINDOW_MS * 1000, (ROLL_MODE != 0)
+};
+static volatile uint32_t cfg_seq = 0; // written by the setters only
+static uint32_t cfg_applied = 0;      // core-1 only
+
+// Start and finish a change to the settings - from one core at a time
+static void cfg_begin (void)
+{
+    cfg_seq = cfg_seq + 1;
+    __dmb ();
+} // cfg_begin
+
+static void cfg_end (void)
+{
+    __dmb ();
+    cfg_seq = cfg_seq + 1;
+} // cfg_end
+
+// Take up any new settings - on core-1, before each sample
+static void cfg_apply (void)
+{
+    const uint32_t seq = cfg_seq;
+    if ((seq == cfg_applied) || (seq & 1))
+    {
+        return; // nothing new, or a change still being written
+    }
+    __dmb ();
+    const scan_cfg cfg = cfg_new;
+    __dmb ();
+    if (cfg_seq != seq)
+    {
+        return; // changed again while we read it, try the next sample
+    }
+    cfg_applied = seq;
+
+    scan_active_us = cfg.active_us;
+#if (KB_SCAN_MODE == SCAN_TIMER)
+    scan_idle_us = cfg.idle_us;
+#endif // SCAN_TIMER
+    db_window_us = cfg.db_window_us;
+    db_set_samples ();
+    if (cfg.roll_on != roll_mode)
+    {
+        roll_stale = 0;
+    }
+    roll_mode = cfg.roll_on;
+    roll_window_us = cfg.roll_window_us;
+} // cfg_apply
+
+// Feed one sample of the keys through the debounce and into the chord.
+// "timed" is set for samples taken at the active scan rate, see debounce().
+// Returns the debounced keys, so zero means the keyboard is idle.
+static uint32_t scan_sample (uint32_t raw, bool timed)
+{
+    cfg_apply ();
+
+    uint32_t all_bits = debounce (raw, timed);
+    uint32_t changed = all_bits ^ db_prev;
+    uint32_t now = time_us_32 ();
+
+    if (changed)
+    {
+        note_edges (all_bits & changed, db_prev & changed, now);
+        db_prev = all_bits;
+    }
+
+    // Chords using a hold key (Rept) are never rolled, see below
+    if ((roll_mode) && (((chord_cur.bits | all_bits) & KB_HOLD_KEYS) == 0))
+    {
+        roll_sample (all_bits, now);
+        return all_bits;
+    }
+
+    roll_stale &= all_bits; // in case we were rolling, drop any leftover keys
+
+    uint32_t live = all_bits & ~roll_stale;
+    if (live)
+    {
+        chord_add (live);
+
+        // A chord held open by a hold key is passed on as soon as all its
+        // other keys are released, while the hold key is still down. The hold
+        // key then starts a new chord, which ends when it is released.
+        if (((live & ~KB_HOLD_KEYS) == 0) && (chord_cur.bits & ~KB_HOLD_KEYS))
+        {
+            chord_cur.held = 1;
+            chord_end ();
+        }
+    }
+    // When ALL keys are released, the chord is complete.
+    else if (chord_cur.bits != 0)
+    {
+        chord_end ();
+    }
+    return all_bits;
+} // scan_sample
+#endif // !SCAN_PIO
+
+#if (KB_SCAN_MODE == SCAN_IRQ) || (KB_SCAN_MODE == SCAN_TIMER)
+// The scan timer runs from its own alarm pool, created on core-1 so that its
+// interrupts are delivered to core-1 (the default pool belongs to core-0)
+static alarm_pool_t *scan_pool = NULL;
+static repeating_timer_t scan_timer;
+#endif // SCAN_IRQ || SCAN_TIMER
+
+#if (KB_SCAN_MODE == SCAN_IRQ)
+static volatile bool settling = false; // is the settle timer running?
+
+// Is there a release still to be debounced?
+static inline bool settle_pending (uint32_t keys, uint32_t raw)
+{
+    return (keys & ~raw) != 0;
+} // settle_pending
+
+// Settle timer handler - samples at the active rate from a release edge,
+// until the release has been debounced, then stops. Keys simply held down
+// need no sampling, the next edge will wake us.
+static bool settle_timer_cb (repeating_timer_t *rt)
+{
+    uint32_t raw = read_keys ();
+    if (!settle_pending (scan_sample (raw, true), raw))
+    {
+        settling = false;
+        return false; // settled, back to waiting for an edge
+    }
+    return true; // keep sampling
+} // settle_timer_cb
+
+// GPIO edge interrupt handler - runs on core-1, since that is where it was enabled
+static void key_edge_cb (uint gpio, uint32_t events)
+{
+    uint32_t now_keys = read_keys ();
+    uint32_t raw = now_keys;
+
+    // A tap shorter than the interrupt latency has already gone again by the
+    // time we read the pins, but the latched falling edge still tells us it happened.
+    if (events & GPIO_IRQ_EDGE_FALL)
+    {
+        raw |= map_keys (gather_pins (1u << gpio));
+    }
+
+    // Edges alone cannot time a release, so once one starts, sample until
+    // it is debounced
+    if ((settle_pending (scan_sample (raw, false), now_keys)) && (!settling))
+    {
+        settling = true;
+        alarm_pool_add_repeating_timer_us (scan_pool, -(int64_t)scan_active_us, settle_timer_cb, NULL, &scan_timer);
+    }
+} // key_edge_cb
+#endif // SCAN_IRQ
+
+#if (KB_SCAN_MODE == SCAN_TIMER)
+static uint32_t last_key_us = 0; // when a key was last seen down
+
+// Scan timer handler - runs on core-1, at a fixed period
+static bool scan_timer_cb (repeating_timer_t *rt)
+{
+    uint32_t now = time_us_32 ();
+
+    if (scan_sample (read_keys (), true))
+    {
+        last_key_us = now;
+    }
+
+    // Scan fast while keys are down or were recently released, else go slow.
+    // A negative delay times the next sample from the start of this one, so
+    // the sample spacing does not drift with the handler run time.
+    if ((now - last_key_us) < (SCAN_LINGER_MS * 1000))
+    {
+        rt->delay_us = -(int64_t)scan_active_us;
+    }
+    else
+    {
+        rt->delay_us = -(int64_t)scan_idle_us;
+    }
+    return true; // keep repeating
+} // scan_timer_cb
+#endif // SCAN_TIMER
+
+#if (KB_SCAN_MODE == SCAN_PIO)
+// The state machine pushes each new combination of keys, and an all ones
+// marker at the end of the chord. DMA copies them into this ring, which must
+// be aligned to its size for the DMA ring wrap to work.
+#define PR_SZ 256
+#define PR_MSK (PR_SZ - 1)
+#define PR_END 0xFFFFFFFF
+static uint32_t pio_ring [PR_SZ] __attribute__ ((aligned (PR_SZ * sizeof (uint32_t))));
+static uint32_t pr_out = 0;
+
+static PIO  chord_pio = pio0;
+static uint chord_sm = 0;
+static int  chord_dma = -1;
+static int32_t chords_pending = 0; // end of chord IRQs not yet matched by a marker
+static uint  chord_base = 0;       // lowest switch pin - the PIO reads up from here
+
+// Work out the state machine clock divider that gives the debounce window
+static float pio_clkdiv (void)
+{
+    float div = (float)clock_get_hz (clk_sys) * (float)db_window_us;
+    div /= 1000000.0f * (kb_chord_RELEASE_PASSES * kb_chord_RELEASE_CYCLES);
+    if (div < 1.0f) div = 1.0f;
+    if (div > 65535.0f) div = 65535.0f;
+    return div;
+} // pio_clkdiv
+
+// PIO interrupt handler - runs on core-1, once at the end of each chord.
+static void pio_chord_isr (void)
+{
+    pio_interrupt_clear (chord_pio, chord_sm);
+    ++chords_pending;
+
+    // The marker is pushed just before the IRQ is raised, so the DMA may
+    // still be a few cycles behind - keep going until it has caught up.
+    while (chords_pending > 0)
+    {
+        uint32_t wr = (uint32_t)dma_channel_hw_addr (chord_dma)->write_addr;
+        wr = ((wr - (uint32_t)pio_ring) / sizeof (uint32_t)) & PR_MSK;
+
+        while (pr_out != wr)
+        {
+            uint32_t bits = pio_ring [pr_out];
+            pr_out = (pr_out + 1) & PR_MSK;
+
+            // OR all the bits together, until the end of the chord.
+            // The PIO does not time its samples, so the hold time is unknown.
+            if (bits != PR_END)
+            {
+                bits = map_keys (gather_pins (bits << chord_base));
+                // A switch the hand in use does not have maps to nothing
+                if ((chord_cur.bits == 0) && (bits != 0))
+                {
+                    chord_cur.first = (uint8_t)__builtin_ctz (bits);
+                }
+                chord_add (bits);
+            }
+            else
+            {
+                chord_end ();
+                --chords_pending; // may go negative if we got ahead of the IRQ
+            }
+        }
+    }
+} // pio_chord_isr
+
+// Load the chord accumulator into a free state machine, and start the DMA
+static void pio_scan_init (void)
+{
+    // The PIO can only read a block of consecutive pins, so the switches
+    // can be in any order, but must be on KB_NUM_PINS pins in a row.
+    int idx;
+    uint32_t used = 0;
+    chord_base = NUM_BANK0_GPIOS;
+    for (idx = 0; idx < KB_NUM_PINS; ++idx)
+    {
+        used |= 1u << kb_pins [idx];
+        if (kb_pins [idx] < chord_base) chord_base = kb_pins [idx];
+    }
+    if (used != (PINS_MASK << chord_base))
+    {
+        panic ("SCAN_PIO needs the key switches on consecutive pins");
+    }
+
+    uint offset = pio_add_program (chord_pio, &kb_chord_program);
+    chord_sm = (uint)pio_claim_unused_sm (chord_pio, true);
+
+    chord_dma = dma_claim_unused_channel (true);
+    dma_channel_config c = dma_channel_get_default_config (chord_dma);
+    channel_config_set_transfer_data_size (&c, DMA_SIZE_32);
+    channel_config_set_read_increment (&c, false);
+    channel_config_set_write_increment (&c, true);
+    channel_config_set_ring (&c, true, __builtin_ctz (sizeof (pio_ring))); // wrap the writes around the ring
+    channel_config_set_dreq (&c, pio_get_dreq (chord_pio, chord_sm, false));
+    dma_channel_configure (chord_dma, &c, pio_ring, &chord_pio->rxf [chord_sm], 0xFFFFFFFF, true);
+
+    pio_set_irq0_source_enabled (chord_pio, (enum pio_interrupt_source)(pis_interrupt0 + chord_sm), true);
+    irq_set_exclusive_handler (PIO0_IRQ_0, pio_chord_isr);
+    irq_set_enabled (PIO0_IRQ_0, true);
+
+    kb_chord_program_init (chord_pio, chord_sm, offset, chord_base, KB_NUM_PINS, pio_clkdiv ());
+} // pio_scan_init
+#endif // SCAN_PIO
+
+#if (KB_SCAN_MODE != SCAN_POLL) && (KB_SCAN_MODE != SCAN_PIO)
+// Change the active and idle scan rates, in Hz, at runtime, from either core.
+// The new rate takes effect from the next sample. In SCAN_IRQ mode, only the
+// active rate is used, to time a release until it is debounced.
+void scan_set_rates (uint32_t active_hz, uint32_t idle_hz)
+{
+    if ((active_hz == 0) || (idle_hz == 0)) return; // nonsense, ignore it
+
+    cfg_begin ();
+    cfg_new.active_us = 1000000 / active_hz;
+    cfg_new.idle_us = 1000000 / idle_hz;
+    cfg_end ();
+} // scan_set_rates
+#endif // !SCAN_POLL && !SCAN_PIO
+
+// Change the debounce window, in ms, at runtime, from either core.
+// Zero gives the minimum, a release is accepted on the first sample that sees it.
+void scan_set_debounce (uint32_t window_ms)
+{
+#if (KB_SCAN_MODE == SCAN_PIO)
+    db_window_us = window_ms * 1000;
+    pio_sm_set_clkdiv (chord_pio, chord_sm, pio_clkdiv ()); // the PIO times the window itself
+#else
+    cfg_begin ();
+    cfg_new.db_window_us = window_ms * 1000;
+    cfg_end ();
+#endif // SCAN_PIO
+} // scan_set_debounce
+
+#if (KB_SCAN_MODE != SCAN_PIO)
+// Turn rolling mode on or off at runtime, and set its overlap window, in ms,
+// from either core. Takes effect from the next sample.
+void scan_set_rolling (bool on, uint32_t window_ms)
+{
+    cfg_begin ();
+    cfg_new.roll_window_us = window_ms * 1000;
+    cfg_new.roll_on = on;
+    cfg_end ();
+} // scan_set_rolling
+#endif // !SCAN_PIO
+
+// Set up the scanner - must be called from core-1, so that the GPIO
+// interrupts (if used) are delivered to core-1 and not to the USB core.
+void scan_init (void)
+{
+#if !(KB_TWO_HAND)
+    key_map_init ();
+#endif // !KB_TWO_HAND
+    db_set_samples ();
+
+#if (KB_SCAN_MODE == SCAN_IRQ)
+    scan_pool = alarm_pool_create (SCAN_ALARM_NUM, 4);
+
+    int idx;
+    gpio_set_irq_enabled_with_callback (kb_pins [0], GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, true, key_edge_cb);
+    for (idx = 1; idx < KB_NUM_PINS; ++idx)
+    {
+        gpio_set_irq_enabled (kb_pins [idx], GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, true);
+    }
+#elif (KB_SCAN_MODE == SCAN_TIMER)
+    last_key_us = time_us_32 ();
+    scan_pool = alarm_pool_create (SCAN_ALARM_NUM, 4);
+    alarm_pool_add_repeating_timer_us (scan_pool, -(int64_t)scan_active_us, scan_timer_cb, NULL, &scan_timer);
+#elif (KB_SCAN_MODE == SCAN_PIO)
+    pio_scan_init ();
+#endif // SCAN_PIO
+} // scan_init
+
+/* Wait for the next complete chord, and fill in its record - mainly the OR
+ * of all the keys that were pressed during it. Only returns once all keys
+ * are released. */
+void scan_get_chord (chord_rec *rec)
+{
+    while (true)
+    {
+        // Check with interrupts masked, so a chord cannot slip in between
+        // the test and the WFI. A pending interrupt still wakes the WFI, and
+        // is then serviced as soon as interrupts are restored.
+        uint32_t save = save_and_disable_interrupts ();
+        if (cq_in != cq_out)
+        {
+            *rec = chord_q [cq_out & CQ_MSK];
+            cq_out = cq_out + 1;
+            restore_interrupts (save);
+            return;
+        }
+#if (KB_SCAN_MODE != SCAN_POLL)
+        __wfi (); // nothing to do, sleep until the next interrupt
+        restore_interrupts (save);
+#else // SCAN_POLL
+        restore_interrupts (save);
+
+        // read the keys, then sleep until the next poll
+        scan_sample (read_keys (), true);
+        if (cq_in == cq_out)
+        {
+            sleep_ms (SCAN_POLL_MS);
+        }
+#endif // SCAN_POLL
+    }
+} // scan_get_chord
+
+// How many completed chords have been lost because the queue was full
+uint32_t scan_chord_drops (void)
+{
+    return cq_drops;
+} // scan_chord_drops
+
+/* Fetch the oldest logged key edge, returns false if there are none.
+ * The log only holds the last EQ_SZ edges; in SCAN_PIO mode it is empty,
+ * since the PIO does not report its edges. */
+bool scan_get_edge (key_edge *edge)
+{
+    bool got = false;
+    uint32_t save = save_and_disable_interrupts ();
+    if (eq_in != eq_out)
+    {
+        *edge = edge_q [eq_out];
+        eq_out = (eq_out + 1) & EQ_MSK;
+        got = true;
+    }
+    restore_interrupts (save);
+    return got;
+} // scan_get_edge
+
+/* End of File */
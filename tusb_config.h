@@ -100,7 +100,13 @@
 #endif
 
 //------------- CLASS -------------//
-#define CFG_TUD_HID               1
+// With HID_NKRO set, there is a second HID interface, an NKRO keyboard with
+// a bitmap report, as well as the usual 6 key one (see usb_descriptors.c)
+#ifndef HID_NKRO
+#define HID_NKRO                  0
+#endif
+
+#define CFG_TUD_HID               (1 + HID_NKRO)
 #define CFG_TUD_CDC               0
 #define CFG_TUD_MSC               0
 #define CFG_TUD_MIDI              0
@@ -37,6 +37,7 @@
 // local parts
 #include "usb_descriptors.h"
 #include "kb-main.h"
+#include "kb-layout.h"
 
 /* Blink pattern */
 enum  {
@@ -73,6 +74,11 @@ void tud_umount_cb(void)
   blink_state = BLINK_NOT_MOUNTED;
 } // tud_umount_cb
 
+// Set once we have asked the host to wake up, so it is only asked once
+static bool wakeup_sent = false;
+
+static void hid_flush(void);
+
 // Invoked when USB is suspended
 // remote_wakeup_en : if host allow us to perform remote wakeup then
 // within 7ms, device must draw an average current less than 2.5 mA from bus
@@ -80,55 +86,123 @@ void tud_suspend_cb(bool remote_wakeup_en)
 {
   (void) remote_wakeup_en;
   blink_state = BLINK_SUSPENDED;
+  wakeup_sent = false;
 } // tud_suspend_cb
 
 // Invoked when USB bus is resumed
+// Any keys queued while suspended (including the one that woke the host) go now
 void tud_resume_cb(void)
 {
   blink_state = BLINK_MOUNTED;
+  wakeup_sent = false;
+  hid_flush();
 } // tud_resume_cb
 
 //--------------------------------------------------------------------+
 // USB HID
 //--------------------------------------------------------------------+
 
-static void send_hid_report(uint8_t report_id, uint32_t btn)
+// use to avoid sending multiple consecutive zero reports for the keyboard
+static bool has_keyboard_key = false;
+
+/* The keys down on the host now, oldest first. The 6 key report holds the
+ * newest six; the NKRO report has room for any number, but only NKRO_HELD
+ * are kept down at once, so no key is down long enough for the host's own
+ * typematic repeat to start. */
+#define BOOT_HELD  6
+#define NKRO_HELD 16
+
+#if (HID_NKRO)
+#define KEYS_HELD NKRO_HELD
+#else
+#define KEYS_HELD BOOT_HELD
+#endif
+
+typedef struct
+{
+  uint8_t mods;
+  uint8_t count;
+  uint8_t keys[KEYS_HELD];
+} key_set;
+
+static key_set key_out;
+
+#if (HID_NKRO)
+// Send on the NKRO keyboard? Only changed with no keys down, so they are
+// always released on the keyboard that pressed them
+static bool nkro_on = false;
+static bool nkro_wanted = true; // the host can turn it off (or on again)
+#else
+static const bool nkro_on = false;
+#endif // HID_NKRO
+
+// Is the keyboard idle, with no key currently held down on the host?
+bool hid_key_idle(void)
+{
+  return !has_keyboard_key;
+} // hid_key_idle
+
+// core-1 builds kb_report to be sent as it is, so it must match the boot keyboard report
+TU_VERIFY_STATIC(sizeof(kb_report) == sizeof(hid_keyboard_report_t), "kb_report does not match the HID report");
+
+// Is the keyboard in use free for the next report?
+static bool hid_ready(void)
+{
+  return tud_hid_n_ready(nkro_on ? HID_ITF_NKRO : HID_ITF_KEYBOARD);
+} // hid_ready
+
+// The keys are sent on whichever keyboard is in use - tinyusb copies the report to the endpoint buffer
+// Returns false if it could not be sent, and should be tried again later
+static bool send_hid_report(uint8_t report_id, key_set const *ks)
 {
   // skip if hid is not ready yet
-  if ( !tud_hid_ready() ) return;
+  if ( !hid_ready() ) return false;
 
   switch(report_id)
   {
     case REPORT_ID_KEYBOARD:
     {
-      // use to avoid sending multiple consecutive zero reports for the keyboard
-      static bool has_keyboard_key = false;
-
-      if ( btn )
+      static const key_set no_keys;
+      if ( !ks )
       {
-        msg_blk code;
-        code.u_msg = btn; // use the union to ease unpacking of the key code message
-        uint8_t Mods = code.p[3];
-        uint8_t keycode[6] = { 0 };
-        keycode[0] = code.p[2];
-        keycode[1] = code.p[1];
-        keycode[2] = code.p[0];
-        keycode[3] = 0;
-        keycode[4] = 0;
-        keycode[5] = 0;
-
-        tud_hid_keyboard_report(REPORT_ID_KEYBOARD, Mods, keycode); // KEY DOWN, in effect
-        has_keyboard_key = true;
+        // send an empty key report if previously had key pressed - KEY UP effectively
+        if ( !has_keyboard_key ) break;
+        ks = &no_keys;
       }
-      else
+
+#if (HID_NKRO)
+      if ( nkro_on )
       {
-        // send an empty key report if previously had key pressed - KEY UP effectively
-        if (has_keyboard_key)
+        nkro_report nkro;
+        memset(&nkro, 0, sizeof(nkro));
+        nkro.mods = ks->mods;
+        for (uint32_t idx = 0; idx < ks->count; ++idx)
         {
-          tud_hid_keyboard_report(REPORT_ID_KEYBOARD, 0, NULL);
-          has_keyboard_key = false;
+          uint8_t const key = ks->keys[idx];
+          if ( key >= HID_KEY_CONTROL_LEFT )
+          {
+            nkro.mods |= (uint8_t)(1 << ((key - HID_KEY_CONTROL_LEFT) & 7)); // a modifier as a key
+          }
+          else if ( key < NKRO_KEYS )
+          {
+            nkro.bits[key >> 3] |= (uint8_t)(1 << (key & 7));
+          }
         }
+        if ( !tud_hid_n_report(HID_ITF_NKRO, 0, &nkro, sizeof(nkro)) ) return false;
       }
+      else
+#endif // HID_NKRO
+      {
+        // the newest six keys
+        kb_report rpt;
+        uint32_t const first = (ks->count > BOOT_HELD) ? (ks->count - BOOT_HELD) : 0;
+        memset(&rpt, 0, sizeof(rpt));
+        rpt.mods = ks->mods;
+        memcpy(rpt.keys, &ks->keys[first], ks->count - first);
+        if ( !tud_hid_n_report(HID_ITF_KEYBOARD, REPORT_ID_KEYBOARD, &rpt, sizeof(rpt)) ) return false;
+      }
+      key_out = *ks;
+      has_keyboard_key = (ks->mods != 0) || (ks->count != 0); // unless a sequence released them
     }
     break;
 
@@ -140,50 +214,184 @@ static void send_hid_report(uint8_t report_id, uint32_t btn)
     default:
     break;
   }
+  return true;
 } // send_hid_report
 
-// Every 10ms, we will send 1 report for each HID profile (keyboard, mouse etc.)
-// tud_hid_report_complete_cb() is used to send the next report after previous one is complete
-void hid_task(void)
+// The keys in a report from core-1
+static void report_keys(key_set *ks, kb_report const *rpt)
 {
-  // Poll every PW_POLL (nominally 10ms)
-  const uint32_t interval_ms = PW_POLL;
-  static uint32_t start_ms = 0;
+  memset(ks, 0, sizeof(*ks));
+  ks->mods = rpt->mods;
+  for (uint32_t idx = 0; (idx < sizeof(rpt->keys)) && (rpt->keys[idx] != 0); ++idx)
+  {
+    ks->keys[ks->count++] = rpt->keys[idx];
+  }
+} // report_keys
+
+/* Rollover - a key can go down while the keys before it are still down, as
+ * long as it has the same modifiers and is not already down (or the host
+ * would not see a new key press). So a burst of keys goes as A, A+B, A+B+C...
+ * one report each, rather than a press and a release each. Once all the
+ * slots are in use, the oldest key is let go to make room. The text typed is
+ * just the same, as the host only types a key when it goes down. */
+static bool can_roll(kb_report const *rpt)
+{
+#if (HID_ROLLOVER)
+  // only a lone key rolls over
+  if ( (rpt->keys[0] == 0) || (rpt->keys[1] != 0) || (rpt->mods != key_out.mods) ) return false;
 
-  if ( board_millis() - start_ms < interval_ms) return; // not enough time has elapsed since last poll
-  start_ms += interval_ms;
+  for (uint32_t idx = 0; idx < key_out.count; ++idx)
+  {
+    if ( key_out.keys[idx] == rpt->keys[0] ) return false; // a repeated key must be released first
+  }
+  return true;
+#else
+  (void) rpt;
+  return false;
+#endif // HID_ROLLOVER
+} // can_roll
+
+// The keys down now, with this one added to them
+static void roll_key(key_set *next, kb_report const *rpt)
+{
+  uint32_t const held = nkro_on ? NKRO_HELD : BOOT_HELD;
+
+  *next = key_out;
+  if ( next->count >= held )
+  {
+    // all in use - let go of the oldest
+    memmove(&next->keys[0], &next->keys[1], held - 1);
+    next->count = held - 1;
+  }
+  next->keys[next->count++] = rpt->keys[0];
+} // roll_key
+
+// A report taken from the queue, but still to be sent - e.g. waiting for a release
+static kb_report *pending = NULL;
+static bool pending_last = false;
+
+// While the bus is suspended, nothing can be sent (the HID endpoints are not
+// ready), so ask the host to wake up if there is anything to send, and leave
+// it all queued until tud_resume_cb(). Returns true if suspended.
+static bool hid_wakeup(void)
+{
+  if ( !tud_suspended() ) return false;
+
+  // Wake up host if we are in suspend mode
+  // and REMOTE_WAKEUP feature is enabled by host
+  if ( !wakeup_sent && (pending || kc_waiting()) )
+  {
+    wakeup_sent = tud_remote_wakeup();
+  }
+  return true;
+} // hid_wakeup
 
-  uint32_t const btn = kc_get ();
+// Send the next queued report, or a key release when one is needed.
+// Only called when the endpoint is free, so each one goes straight out.
+static void hid_send_next(void)
+{
+  // Part way through a sequence, which goes just as it was built
+  static bool in_seq = false;
+  key_set next;
+  bool sent;
+
+  if ( tud_suspended() ) return; // hid_wakeup() deals with it, all stays queued
+
+#if (HID_NKRO)
+  // Pick the keyboard to use, between sequences. The NKRO one is used once the
+  // host has set it up, unless the host has asked for the boot protocol.
+  if ( !has_keyboard_key && !in_seq )
+  {
+    nkro_on = nkro_wanted && tud_mounted() &&
+              (tud_hid_n_get_protocol(HID_ITF_KEYBOARD) != HID_PROTOCOL_BOOT);
+    if ( !hid_ready() ) return; // the callback will be back when it is free
+  }
+#endif // HID_NKRO
+
+  if ( !pending )
+  {
+    pending = kc_get(&pending_last);
+  }
+
+  if ( !pending )
+  {
+    // nothing more to send - let go of the keys
+    send_hid_report(REPORT_ID_KEYBOARD, NULL);
+    return;
+  }
 
-  // Remote wakeup
-  if ( tud_suspended() && btn )
+  if ( in_seq || !has_keyboard_key )
+  {
+    report_keys(&next, pending);
+    sent = send_hid_report(REPORT_ID_KEYBOARD, &next);
+  }
+  else if ( can_roll(pending) )
   {
-    // Wake up host if we are in suspend mode
-    // and REMOTE_WAKEUP feature is enabled by host
-    tud_remote_wakeup();
+    roll_key(&next, pending);
+    sent = send_hid_report(REPORT_ID_KEYBOARD, &next);
   }
   else
   {
-    // Send the 1st element of the report chain, the rest will be sent by tud_hid_report_complete_cb()
-    send_hid_report(REPORT_ID_KEYBOARD, btn);
+    // release the keys first, the report goes next time
+    send_hid_report(REPORT_ID_KEYBOARD, NULL);
+    return;
+  }
+
+  // done with the report slot, give it back
+  if ( sent )
+  {
+    in_seq = !pending_last;
+    report_drop(pending);
+    pending = NULL;
   }
+} // hid_send_next
+
+// Start sending straight away, if the endpoint is idle, without waiting for
+// hid_task() - used after a resume. In the event driven mode the rest
+// follow from tud_hid_report_complete_cb(), at the host's polling rate.
+static void hid_flush(void)
+{
+  if ( hid_ready() ) hid_send_next();
+} // hid_flush
+
+#if (PW_EVENT_HID)
+// Start sending, if the endpoint is idle - after that, each report is sent
+// from tud_hid_report_complete_cb() as soon as the one before it has gone,
+// so reports go at the host's polling rate, not at the rate of a timer.
+void hid_task(void)
+{
+  if ( hid_wakeup() ) return; // suspended - the endpoint is not ready until the resume
+  hid_flush(); // if a report is on its way, the callback carries on
+} // hid_task
+#else
+// Every PW_POLL ms, we will send 1 report
+void hid_task(void)
+{
+  // Poll every PW_POLL (nominally 10ms)
+  const uint32_t interval_ms = PW_POLL;
+  static uint32_t start_ms = 0;
+
+  if ( hid_wakeup() ) return; // suspended - nothing can go until the resume
+
+  if ( board_millis() - start_ms < interval_ms) return; // not enough time has elapsed since last poll
+  start_ms += interval_ms;
+
+  hid_send_next();
 } // hid_task
+#endif // PW_EVENT_HID
 
-// Invoked when sent REPORT successfully to host
-// Application can use this to chain to the next report - though since we only have the keyboard now,
-// that seems unlikely to actually do anything!
-// Note: For composite reports, report[0] is report ID
+// Invoked when sent REPORT successfully to host, on either keyboard
+// In the event driven mode, this chains on to the next report straight away.
+// Runs from tud_task(), which main() calls with the FIFO interrupt held off.
 void tud_hid_report_complete_cb(uint8_t instance, uint8_t const* report, uint8_t len)
 {
   (void) instance;
+  (void) report;
   (void) len;
 
-  uint8_t next_report_id = report[0] + 1;
-
-  if (next_report_id < REPORT_ID_COUNT)
-  {
-    send_hid_report(next_report_id, board_button_read());
-  }
+#if (PW_EVENT_HID)
+  hid_send_next();
+#endif // PW_EVENT_HID
 } // tud_hid_report_complete_cb
 
 // Invoked when we receive a GET_REPORT control request
@@ -191,12 +399,16 @@ void tud_hid_report_complete_cb(uint8_t instance, uint8_t const* report, uint8_t
 // Return zero will cause the stack to STALL request
 uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t* buffer, uint16_t reqlen)
 {
-  // TODO not Implemented
   (void) instance;
-  (void) report_id;
-  (void) report_type;
-  (void) buffer;
-  (void) reqlen;
+
+  // The only report the host can ask for is the keymap bank, host layout and keyboard in use
+  if ((report_type == HID_REPORT_TYPE_FEATURE) && (report_id == REPORT_ID_KEYMAP) && (reqlen >= 3))
+  {
+    buffer[0] = (uint8_t) bank_current();
+    buffer[1] = (uint8_t) host_current();
+    buffer[2] = (uint8_t) nkro_on;
+    return 3;
+  }
 
   return 0;
 } // tud_hid_get_report_cb
@@ -204,10 +416,11 @@ uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_t
 /* Invoked when we received SET_REPORT control request or
  * receive data on OUT endpoint ( Report ID = 0, Type = 0 )
  *
- * Here, this is only checking for the CapsLock message from the host,
+ * Here, this is checking for the CapsLock message from the host,
  * which PicoWriter ignores at present - though it possibly could make
- * use of it.
- * All this does is change the board LED, in effect.
+ * use of it. All this does is change the board LED, in effect.
+ * The host can also switch the keymap bank, its own layout and the NKRO keyboard on
+ * or off, with the keymap feature report.
  */
 void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type,
                            uint8_t const* buffer, uint16_t bufsize)
@@ -238,6 +451,17 @@ void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_
       }
     }
   }
+  else if ((report_type == HID_REPORT_TYPE_FEATURE) && (report_id == REPORT_ID_KEYMAP))
+  {
+    // Switch keymap bank and host layout - core-1 picks them up from the next chord
+    if ( bufsize < 1 ) return;
+    bank_select(buffer[0]);
+    if ( bufsize >= 2 ) host_select(buffer[1]);
+#if (HID_NKRO)
+    // and the keyboard to use - hid_send_next() changes over between sequences
+    if ( bufsize >= 3 ) nkro_wanted = (buffer[2] != 0);
+#endif // HID_NKRO
+  }
 } // tud_hid_set_report_cb
 
 //--------------------------------------------------------------------+
@@ -82,21 +82,78 @@ uint8_t const * tud_descriptor_device_cb(void)
 // HID Report Descriptor
 //--------------------------------------------------------------------+
 
+// A vendor defined feature report, three bytes, for the host to read or set
+// the keymap bank, the host layout, and whether to use the NKRO keyboard
+#define TUD_HID_REPORT_DESC_KEYMAP(...) \
+  HID_USAGE_PAGE_N ( HID_USAGE_PAGE_VENDOR, 2 ), \
+  HID_USAGE        ( 0x01                     ), \
+  HID_COLLECTION   ( HID_COLLECTION_APPLICATION ), \
+    /* Report ID if any */ \
+    __VA_ARGS__ \
+    HID_USAGE        ( 0x02                 ), \
+    HID_LOGICAL_MIN  ( 0x00                 ), \
+    HID_LOGICAL_MAX_N( 0xff, 2              ), \
+    HID_REPORT_SIZE  ( 8                    ), \
+    HID_REPORT_COUNT ( 3                    ), \
+    HID_FEATURE      ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ), \
+  HID_COLLECTION_END
+
 uint8_t const desc_hid_report[] =
 {
-  TUD_HID_REPORT_DESC_KEYBOARD( HID_REPORT_ID(REPORT_ID_KEYBOARD         ))
+  TUD_HID_REPORT_DESC_KEYBOARD( HID_REPORT_ID(REPORT_ID_KEYBOARD         )),
+  TUD_HID_REPORT_DESC_KEYMAP  ( HID_REPORT_ID(REPORT_ID_KEYMAP           ))
 /* The original example also provided these endpoints, but we do not need them here... */
   //TUD_HID_REPORT_DESC_MOUSE   ( HID_REPORT_ID(REPORT_ID_MOUSE            )),
   //TUD_HID_REPORT_DESC_CONSUMER( HID_REPORT_ID(REPORT_ID_CONSUMER_CONTROL )),
   //TUD_HID_REPORT_DESC_GAMEPAD ( HID_REPORT_ID(REPORT_ID_GAMEPAD          ))
 };
 
+#if (HID_NKRO)
+// An NKRO keyboard - the modifiers, then a bitmap of the keys that are down
+#define TUD_HID_REPORT_DESC_NKRO(...) \
+  HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP     ), \
+  HID_USAGE      ( HID_USAGE_DESKTOP_KEYBOARD ), \
+  HID_COLLECTION ( HID_COLLECTION_APPLICATION ), \
+    /* Report ID if any */ \
+    __VA_ARGS__ \
+    /* 8 bits Modifier Keys (Shift, Control, Alt) */ \
+    HID_USAGE_PAGE ( HID_USAGE_PAGE_KEYBOARD ), \
+      HID_USAGE_MIN    ( 224                    ), \
+      HID_USAGE_MAX    ( 231                    ), \
+      HID_LOGICAL_MIN  ( 0                      ), \
+      HID_LOGICAL_MAX  ( 1                      ), \
+      HID_REPORT_COUNT ( 8                      ), \
+      HID_REPORT_SIZE  ( 1                      ), \
+      HID_INPUT        ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ), \
+    /* a bit for each key code */ \
+    HID_USAGE_PAGE ( HID_USAGE_PAGE_KEYBOARD ), \
+      HID_USAGE_MIN    ( 0                      ), \
+      HID_USAGE_MAX    ( NKRO_KEYS - 1          ), \
+      HID_LOGICAL_MIN  ( 0                      ), \
+      HID_LOGICAL_MAX  ( 1                      ), \
+      HID_REPORT_COUNT ( NKRO_KEYS              ), \
+      HID_REPORT_SIZE  ( 1                      ), \
+      HID_INPUT        ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ), \
+  HID_COLLECTION_END
+
+uint8_t const desc_hid_nkro_report[] =
+{
+  TUD_HID_REPORT_DESC_NKRO()
+};
+
+TU_VERIFY_STATIC(sizeof(nkro_report) <= CFG_TUD_HID_EP_BUFSIZE, "CFG_TUD_HID_EP_BUFSIZE is too small for the NKRO report");
+#endif // HID_NKRO
+
 // Invoked when received GET HID REPORT DESCRIPTOR
 // Application return pointer to descriptor
 // Descriptor contents must exist long enough for transfer to complete
 uint8_t const * tud_hid_descriptor_report_cb(uint8_t instance)
 {
+#if (HID_NKRO)
+  if (instance == HID_ITF_NKRO) return desc_hid_nkro_report;
+#else
   (void) instance;
+#endif // HID_NKRO
   return desc_hid_report;
 }
 
@@ -107,12 +164,16 @@ uint8_t const * tud_hid_descriptor_report_cb(uint8_t instance)
 enum
 {
   ITF_NUM_HID,
+#if (HID_NKRO)
+  ITF_NUM_HID_NKRO,
+#endif
   ITF_NUM_TOTAL
 };
 
-#define  CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + TUD_HID_DESC_LEN)
+#define  CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + (CFG_TUD_HID * TUD_HID_DESC_LEN))
 
-#define EPNUM_HID   0x81
+#define EPNUM_HID       0x81
+#define EPNUM_HID_NKRO  0x82
 
 uint8_t const desc_configuration[] =
 {
@@ -126,7 +187,16 @@ uint8_t const desc_configuration[] =
                      sizeof(desc_hid_report), // report descriptor length
                      EPNUM_HID,               // EP In address
                      CFG_TUD_HID_EP_BUFSIZE,  // size
+                     PW_POLL),                // polling interval
+#if (HID_NKRO)
+  TUD_HID_DESCRIPTOR(ITF_NUM_HID_NKRO,        // Interface number
+                     0,                       // string index
+                     HID_ITF_PROTOCOL_NONE,   // protocol
+                     sizeof(desc_hid_nkro_report), // report descriptor length
+                     EPNUM_HID_NKRO,          // EP In address
+                     CFG_TUD_HID_EP_BUFSIZE,  // size
                      PW_POLL)                 // polling interval
+#endif // HID_NKRO
 };
 
 #if TUD_OPT_HIGH_SPEED
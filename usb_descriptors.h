@@ -30,9 +30,26 @@
 #ifndef USB_DESCRIPTORS_H_
 #define USB_DESCRIPTORS_H_
 
+// The HID interfaces, as tinyusb numbers them
+enum
+{
+  HID_ITF_KEYBOARD = 0,  // the 6 key keyboard, always there
+  HID_ITF_NKRO           // the NKRO keyboard, with HID_NKRO set
+};
+
+// The NKRO report - the modifiers, then a bit for each of the first NKRO_KEYS key codes
+#define NKRO_KEYS 120
+
+typedef struct TU_ATTR_PACKED
+{
+  uint8_t mods;
+  uint8_t bits[NKRO_KEYS / 8];
+} nkro_report;
+
 enum
 {
   REPORT_ID_KEYBOARD = 1,
+  REPORT_ID_KEYMAP,      // feature report, the keymap bank, host layout and NKRO use
 /* The original example also provided these endpoints, but we do not need them here... */
   //REPORT_ID_MOUSE,
   //REPORT_ID_CONSUMER_CONTROL,